@@ -0,0 +1,316 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Calibration.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+/* Span of the statistics stillness is judged by */
+static constexpr int64_t kStillWindow = 250000000LL;
+/* Summed variances below which a sensor counts as quiet, a few times the
+ * noise of phone grade parts */
+static constexpr float kGyroStillVariance = 1e-4f;
+static constexpr float kAccelStillVariance = 2.5e-3f;
+/* A larger mean rate is a slow turn rather than bias, in rad/s */
+static constexpr float kMaxGyroBias = 0.1f;
+/* Still windows in a row before the bias is taken from them */
+static constexpr unsigned kStillWindows = 4;
+/* How fast the bias follows later still windows, in seconds */
+static constexpr float kBiasTimeConstant = 2.0f;
+/* The accelerometer only counts if its last sample is this recent */
+static constexpr int64_t kAccelTimeout = 100000000LL;
+
+/* How far, relative to the field, a magnetometer sample must be from the
+ * previously used one to be used, about 6 degrees of turn */
+static constexpr float kMagSpacing = 0.1f;
+/* Weight left to the normal equations per sample used, they remember
+ * roughly the last 1 / (1 - kMagForget) samples */
+static constexpr double kMagForget = 0.99;
+/* Samples used before a fit is tried */
+static constexpr unsigned kMagMinSamples = 20;
+/* Least spread of the samples used, along their flattest direction
+ * relative to the widest, for them to go around enough to fit to */
+static constexpr double kMagMinCoverage = 0.05;
+/* Ellipsoids flatter than this are a bad fit, not soft iron */
+static constexpr float kMagMaxAnisotropy = 1.5f;
+/* Weight of each sample in the fit error, and the error a first fit is
+ * assumed to have */
+static constexpr float kMagErrorWeight = 0.1f;
+static constexpr float kMagInitialError = 0.1f;
+
+WindowedVariance::WindowedVariance(int64_t window)
+    : mWindow(window),
+      mStarted(false),
+      mStart(0),
+      mLast(0),
+      mCount(0),
+      mOrigin{ 0.0f, 0.0f, 0.0f },
+      mSum{ 0.0f, 0.0f, 0.0f },
+      mSumSquares(0.0f),
+      mComplete(false),
+      mMean{ 0.0f, 0.0f, 0.0f },
+      mVariance(0.0f) {
+}
+
+void WindowedVariance::reset() {
+    mStarted = false;
+    mComplete = false;
+}
+
+bool WindowedVariance::add(int64_t timestamp, Vector3 const& value) {
+    int64_t const step = timestamp - mLast;
+    mLast = timestamp;
+
+    if (!mStarted || step > mWindow || step < 0) {
+        mStarted = true;
+        mComplete = false;
+        mStart = timestamp;
+        mCount = 0;
+    }
+    if (mCount == 0) {
+        mOrigin = value;
+        mSum = { 0.0f, 0.0f, 0.0f };
+        mSumSquares = 0.0f;
+    }
+
+    /* Summed relative to the first sample of the window, so that noise
+     * of some mm/s^2 doesn't drown in rounding at 10 m/s^2 */
+    Vector3 const delta = value - mOrigin;
+    mCount++;
+    mSum = mSum + delta;
+    mSumSquares += dot(delta, delta);
+
+    if (timestamp - mStart < mWindow)
+        return false;
+
+    Vector3 const mean = mSum * (1.0f / mCount);
+    mMean = mOrigin + mean;
+    mVariance = std::max(0.0f, mSumSquares / mCount - dot(mean, mean));
+    mComplete = true;
+
+    mStart = timestamp;
+    mCount = 0;
+    return true;
+}
+
+GyroBiasEstimator::GyroBiasEstimator()
+    : mGyro(kStillWindow),
+      mAccel(kStillWindow),
+      mBias{ 0.0f, 0.0f, 0.0f },
+      mCalibrated(false),
+      mStillWindows(0) {
+}
+
+bool GyroBiasEstimator::still(int64_t timestamp) const {
+    if (mGyro.variance() > kGyroStillVariance || length(mGyro.mean()) > kMaxGyroBias)
+        return false;
+
+    /* A steady turn around gravity doesn't show here, but most other
+     * handling does */
+    if (timestamp - mAccel.last() < kAccelTimeout)
+        return mAccel.settled(timestamp) && mAccel.variance() <= kAccelStillVariance;
+
+    return true;
+}
+
+void GyroBiasEstimator::addGyro(int64_t timestamp, Vector3 const& rate) {
+    if (!mGyro.add(timestamp, rate)) {
+        /* Stillness must be seen without gaps */
+        if (!mGyro.settled(timestamp))
+            mStillWindows = 0;
+        return;
+    }
+
+    if (!still(timestamp)) {
+        mStillWindows = 0;
+        return;
+    }
+    if (++mStillWindows < kStillWindows)
+        return;
+
+    if (!mCalibrated) {
+        mBias = mGyro.mean();
+        mCalibrated = true;
+    } else {
+        float const alpha = std::min(1.0f, kStillWindow * 1e-9f / kBiasTimeConstant);
+        mBias = mBias + (mGyro.mean() - mBias) * alpha;
+    }
+}
+
+void GyroBiasEstimator::addAccel(int64_t timestamp, Vector3 const& acceleration) {
+    mAccel.add(timestamp, acceleration);
+}
+
+MagneticCalibration::MagneticCalibration()
+    : mStarted(false),
+      mUnit(1.0f),
+      mLast{ 0.0f, 0.0f, 0.0f },
+      mNormal(),
+      mRhs(),
+      mWeight(0.0),
+      mSamples(0),
+      mCalibrated(false),
+      mScale{ 1.0f, 1.0f, 1.0f },
+      mBias{ 0.0f, 0.0f, 0.0f },
+      mRadius(0.0f),
+      mFitVariance(kMagInitialError * kMagInitialError) {
+}
+
+void MagneticCalibration::add(Vector3 const& raw) {
+    float const magnitude = length(raw);
+    if (!(magnitude > 0.0f))
+        return;
+
+    if (!mStarted) {
+        mStarted = true;
+        mUnit = magnitude;
+    } else if (length(raw - mLast) < kMagSpacing * magnitude) {
+        return;
+    }
+    mLast = raw;
+
+    /* Judge the fit by samples it wasn't made from */
+    if (mCalibrated) {
+        float const error = length(scale(raw) - mBias) / mRadius - 1.0f;
+        mFitVariance += (error * error - mFitVariance) * kMagErrorWeight;
+    }
+
+    accumulate(raw);
+    if (mSamples >= kMagMinSamples)
+        fit();
+}
+
+void MagneticCalibration::accumulate(Vector3 const& raw) {
+    double const x = raw.x / mUnit;
+    double const y = raw.y / mUnit;
+    double const z = raw.z / mUnit;
+    double const row[6] = { x * x, y * y, z * z, x, y, z };
+
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 6; j++)
+            mNormal[i][j] = mNormal[i][j] * kMagForget + row[i] * row[j];
+        mRhs[i] = mRhs[i] * kMagForget + row[i];
+    }
+    mWeight = mWeight * kMagForget + 1.0;
+    mSamples++;
+}
+
+bool MagneticCalibration::covered() const {
+    /* The covariance of the samples is in the normal equations already */
+    double mean[3];
+    for (int i = 0; i < 3; i++)
+        mean[i] = mRhs[3 + i] / mWeight;
+
+    double c[3][3];
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            c[i][j] = mNormal[3 + i][3 + j] / mWeight - mean[i] * mean[j];
+
+    /* Eigenvalues of a symmetric 3x3 matrix in closed form */
+    double const q = (c[0][0] + c[1][1] + c[2][2]) / 3.0;
+    double const off = c[0][1] * c[0][1] + c[0][2] * c[0][2] + c[1][2] * c[1][2];
+    double const p2 = (c[0][0] - q) * (c[0][0] - q) + (c[1][1] - q) * (c[1][1] - q) +
+                      (c[2][2] - q) * (c[2][2] - q) + 2.0 * off;
+    if (p2 <= 0.0)
+        return q > 0.0;
+
+    double const p = sqrt(p2 / 6.0);
+    double b[3][3];
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            b[i][j] = (c[i][j] - (i == j ? q : 0.0)) / p;
+    double const det = b[0][0] * (b[1][1] * b[2][2] - b[1][2] * b[2][1]) -
+                       b[0][1] * (b[1][0] * b[2][2] - b[1][2] * b[2][0]) +
+                       b[0][2] * (b[1][0] * b[2][1] - b[1][1] * b[2][0]);
+    double const phi = acos(std::max(-1.0, std::min(1.0, det / 2.0))) / 3.0;
+
+    double const largest = q + 2.0 * p * cos(phi);
+    double const smallest = q + 2.0 * p * cos(phi + 2.0 * M_PI / 3.0);
+    return largest > 0.0 && smallest >= kMagMinCoverage * largest;
+}
+
+void MagneticCalibration::fit() {
+    if (!covered())
+        return;
+
+    double a[6][7];
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 6; j++)
+            a[i][j] = mNormal[i][j];
+        a[i][6] = mRhs[i];
+    }
+
+    /* Gaussian elimination with partial pivoting. Samples that don't go
+     * around leave the equations singular, keep the previous fit then. */
+    for (int col = 0; col < 6; col++) {
+        int pivot = col;
+        for (int i = col + 1; i < 6; i++)
+            if (fabs(a[i][col]) > fabs(a[pivot][col]))
+                pivot = i;
+        if (fabs(a[pivot][col]) < 1e-9 * fabs(mNormal[col][col]) || a[pivot][col] == 0.0)
+            return;
+        if (pivot != col)
+            for (int j = col; j < 7; j++)
+                std::swap(a[col][j], a[pivot][j]);
+
+        for (int i = col + 1; i < 6; i++) {
+            double const f = a[i][col] / a[col][col];
+            for (int j = col; j < 7; j++)
+                a[i][j] -= f * a[col][j];
+        }
+    }
+
+    double p[6];
+    for (int i = 5; i >= 0; i--) {
+        double sum = a[i][6];
+        for (int j = i + 1; j < 6; j++)
+            sum -= a[i][j] * p[j];
+        p[i] = sum / a[i][i];
+    }
+
+    /* A (x - cx)^2 + B (y - cy)^2 + C (z - cz)^2 = G. All of them are
+     * negative when the hard iron puts the origin outside. */
+    if (!(p[0] * p[1] > 0.0 && p[0] * p[2] > 0.0))
+        return;
+    double const center[3] = { -p[3] / (2 * p[0]), -p[4] / (2 * p[1]), -p[5] / (2 * p[2]) };
+    double const g = 1.0 + p[0] * center[0] * center[0] + p[1] * center[1] * center[1] +
+                     p[2] * center[2] * center[2];
+    if (!(g * p[0] > 0.0))
+        return;
+
+    double const radii[3] = { sqrt(g / p[0]), sqrt(g / p[1]), sqrt(g / p[2]) };
+    double const shortest = std::min(radii[0], std::min(radii[1], radii[2]));
+    double const longest = std::max(radii[0], std::max(radii[1], radii[2]));
+    if (longest > kMagMaxAnisotropy * shortest)
+        return;
+
+    /* Scale the axes to a sphere of the same volume */
+    double const radius = cbrt(radii[0] * radii[1] * radii[2]);
+    mScale = { float(radius / radii[0]), float(radius / radii[1]), float(radius / radii[2]) };
+    mBias = scale({ float(center[0] * mUnit), float(center[1] * mUnit), float(center[2] * mUnit) });
+    mRadius = float(radius * mUnit);
+    mCalibrated = true;
+}
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
@@ -0,0 +1,163 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDBOX_HARDWARE_SENSORS_CALIBRATION_H_
+#define ANDBOX_HARDWARE_SENSORS_CALIBRATION_H_
+
+#include <stdint.h>
+
+#include "Fusion.h"
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+/*
+ * Mean and variance of a vector signal over consecutive windows of
+ * |window| nanoseconds, from running sums per window, so constant time
+ * and space per sample. The variance is summed over the axes.
+ *
+ * A gap longer than a window starts over.
+ */
+class WindowedVariance {
+public:
+    explicit WindowedVariance(int64_t window);
+
+    /* Returns whether |value| completed a window */
+    bool add(int64_t timestamp, Vector3 const& value);
+    void reset();
+
+    /* Whether the last complete window ended at most a window before
+     * |timestamp| */
+    bool settled(int64_t timestamp) const {
+        return mComplete && timestamp - mStart <= mWindow;
+    }
+    /* Timestamp of the latest sample */
+    int64_t last() const { return mLast; }
+    /* Of the last complete window */
+    Vector3 const& mean() const { return mMean; }
+    float variance() const { return mVariance; }
+
+private:
+    int64_t mWindow;
+    /* The window being filled */
+    bool mStarted;
+    int64_t mStart;
+    int64_t mLast;
+    uint32_t mCount;
+    Vector3 mOrigin;
+    Vector3 mSum;
+    float mSumSquares;
+    /* The last complete one */
+    bool mComplete;
+    Vector3 mMean;
+    float mVariance;
+};
+
+/*
+ * Gyroscope bias, learned while the device lies still.
+ *
+ * The device counts as still while windows of the gyroscope and, if it
+ * streams, the accelerometer are quiet. The gyroscope mean over such a
+ * window is all bias and the estimate follows it, slowly so that
+ * temperature drift is tracked but a careful hand isn't. Constant time
+ * per sample.
+ *
+ * Inputs are stamped in nanoseconds on the same clock.
+ */
+class GyroBiasEstimator {
+public:
+    GyroBiasEstimator();
+
+    /* Angular rate in rad/s */
+    void addGyro(int64_t timestamp, Vector3 const& rate);
+    /* Acceleration in m/s^2 */
+    void addAccel(int64_t timestamp, Vector3 const& acceleration);
+
+    /* In rad/s, zero until calibrated */
+    Vector3 const& bias() const { return mBias; }
+    /* Whether the bias was learned from a still period */
+    bool calibrated() const { return mCalibrated; }
+
+private:
+    bool still(int64_t timestamp) const;
+
+    WindowedVariance mGyro;
+    WindowedVariance mAccel;
+    Vector3 mBias;
+    bool mCalibrated;
+    /* Consecutive still windows */
+    unsigned mStillWindows;
+};
+
+/*
+ * Hard and soft iron calibration of a magnetometer.
+ *
+ * Fits an axis aligned ellipsoid to the raw samples by least squares,
+ * incrementally: each sample adds to the normal equations of the fit,
+ * which forget old samples as new ones come in, so the calibration
+ * follows the device into a different magnetic environment. Only samples
+ * that moved away from the previous one are used, a device at rest
+ * doesn't drown out the orientations it has been in, and only once they
+ * spread in all directions. Constant time and space per sample.
+ *
+ * The fit is unit free, samples are normalized by the first one.
+ */
+class MagneticCalibration {
+public:
+    MagneticCalibration();
+
+    void add(Vector3 const& raw);
+
+    /* Whether there is a fit */
+    bool calibrated() const { return mCalibrated; }
+    /* How far recent samples were off the fitted sphere, relative to its
+     * radius, root mean square */
+    float fitError() const { return sqrtf(mFitVariance); }
+    /* |raw| with the soft iron taken out */
+    Vector3 scale(Vector3 const& raw) const {
+        return { raw.x * mScale.x, raw.y * mScale.y, raw.z * mScale.z };
+    }
+    /* The hard iron offset of scale()d samples */
+    Vector3 const& bias() const { return mBias; }
+
+private:
+    void accumulate(Vector3 const& raw);
+    /* Whether the samples go around in all directions */
+    bool covered() const;
+    void fit();
+
+    bool mStarted;
+    float mUnit;
+    Vector3 mLast;
+    /* Normal equations of x^2, y^2, z^2, x, y, z against 1 */
+    double mNormal[6][6];
+    double mRhs[6];
+    double mWeight;
+    unsigned mSamples;
+
+    bool mCalibrated;
+    Vector3 mScale;
+    Vector3 mBias;
+    float mRadius;
+    float mFitVariance;
+};
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
+
+#endif  // ANDBOX_HARDWARE_SENSORS_CALIBRATION_H_
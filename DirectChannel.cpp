@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DirectChannel.h"
+
+#include <gutil_log.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+namespace {
+constexpr size_t kRecordSize = (size_t)SensorsEventFormatOffset::TOTAL_LENGTH;
+
+constexpr size_t offset(SensorsEventFormatOffset field) {
+    return (size_t)field;
+}
+
+static_assert(offset(SensorsEventFormatOffset::RESERVED) -
+              offset(SensorsEventFormatOffset::DATA) == sizeof(SensorEventPayload),
+              "event payload does not fit the direct channel record");
+}
+
+int64_t direct_report_period_ns(RateLevel rate) {
+    /* Nominal rates of the levels: 50Hz, 200Hz and 800Hz */
+    switch (rate) {
+    case RateLevel::NORMAL:
+        return 20000000LL;
+    case RateLevel::FAST:
+        return 5000000LL;
+    case RateLevel::VERY_FAST:
+        return 1250000LL;
+    default:
+        return 0;
+    }
+}
+
+RateLevel direct_report_max_rate(int32_t minDelayUs) {
+    /* Only continuous sensors have a rate to report at */
+    if (minDelayUs <= 0)
+        return RateLevel::STOP;
+
+    int32_t level = (int32_t)RateLevel::NORMAL;
+    while (level < (int32_t)RateLevel::VERY_FAST &&
+           direct_report_period_ns((RateLevel)(level + 1)) >= minDelayUs * 1000LL)
+        level++;
+
+    return (RateLevel)level;
+}
+
+std::unique_ptr<DirectChannel> DirectChannel::create(int fd, size_t size) {
+    if (fd < 0)
+        return nullptr;
+
+    if (size < kRecordSize) {
+        GERR("Direct channel of %zu bytes can't hold a single event", size);
+        close(fd);
+        return nullptr;
+    }
+
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        GERR("Failed to map direct channel: %s", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    return std::unique_ptr<DirectChannel>(
+        new DirectChannel(fd, static_cast<uint8_t*>(base), size));
+}
+
+DirectChannel::DirectChannel(int fd, uint8_t* base, size_t size)
+    : mFd(fd),
+      mBase(base),
+      mSize(size),
+      mSlots(size / kRecordSize),
+      mWritePos(0),
+      mCounter(1),
+      mPeriod(),
+      mLastPosted() {
+}
+
+DirectChannel::~DirectChannel() {
+    munmap(mBase, mSize);
+    close(mFd);
+}
+
+int32_t DirectChannel::configure(int handle, RateLevel rate) {
+    mPeriod[handle] = direct_report_period_ns(rate);
+    /* Let the next event through right away */
+    mLastPosted[handle] = -mPeriod[handle];
+
+    return handle + 1;
+}
+
+bool DirectChannel::isReporting(int handle) const {
+    return mPeriod[handle] > 0;
+}
+
+int64_t DirectChannel::periodNs(int handle) const {
+    return mPeriod[handle];
+}
+
+uint32_t DirectChannel::reportedSensors() const {
+    uint32_t sensors = 0;
+
+    for (int i = 0; i < MAX_NUM_SENSORS; i++)
+        if (isReporting(i))
+            sensors |= 1U << i;
+
+    return sensors;
+}
+
+void DirectChannel::post(sensors_event_t const& event, int64_t now) {
+    int const handle = event.sensorHandle;
+    if (!isReporting(handle))
+        return;
+
+    /* Allow for some jitter of the sensorfw stream */
+    if (now - mLastPosted[handle] < mPeriod[handle] - mPeriod[handle] / 10)
+        return;
+
+    mLastPosted[handle] = now;
+    write(event, handle + 1);
+}
+
+void DirectChannel::write(sensors_event_t const& event, int32_t reportToken) {
+    uint8_t* record = mBase + mWritePos * kRecordSize;
+    uint32_t* counter = reinterpret_cast<uint32_t*>(
+        record + offset(SensorsEventFormatOffset::ATOMIC_COUNTER));
+    int32_t const size = kRecordSize;
+
+    /* Invalidate the record while it is being rewritten */
+    __atomic_store_n(counter, 0, __ATOMIC_RELEASE);
+
+    memcpy(record + offset(SensorsEventFormatOffset::SIZE_FIELD), &size, sizeof(size));
+    memcpy(record + offset(SensorsEventFormatOffset::REPORT_TOKEN), &reportToken, sizeof(reportToken));
+    memcpy(record + offset(SensorsEventFormatOffset::SENSOR_TYPE), &event.sensorType, sizeof(event.sensorType));
+    memcpy(record + offset(SensorsEventFormatOffset::TIMESTAMP), &event.timestamp, sizeof(event.timestamp));
+    memcpy(record + offset(SensorsEventFormatOffset::DATA), &event.u, sizeof(event.u));
+
+    __atomic_store_n(counter, mCounter, __ATOMIC_RELEASE);
+
+    /* 0 marks a record that was never written */
+    if (++mCounter == 0)
+        mCounter = 1;
+    if (++mWritePos == mSlots)
+        mWritePos = 0;
+}
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
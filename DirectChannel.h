@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDBOX_HARDWARE_SENSORS_DIRECT_CHANNEL_H_
+#define ANDBOX_HARDWARE_SENSORS_DIRECT_CHANNEL_H_
+
+#include <memory>
+
+#include "hybrisbindertypes.h"
+#include "SensorFW.h"
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+/* Sampling period of a direct report rate level, 0 for RateLevel::STOP */
+int64_t direct_report_period_ns(RateLevel rate);
+/* Fastest rate level a sensor with |minDelayUs| can be reported at,
+ * RateLevel::STOP if it can't be reported through direct channels */
+RateLevel direct_report_max_rate(int32_t minDelayUs);
+
+/*
+ * Shared memory region a client registered to receive sensor events
+ * without POLL. Events are written as a ring of SensorsEventFormatOffset
+ * records; the atomic counter of a record is written last, so a reader
+ * seeing a new counter value also sees the rest of the record.
+ *
+ * Not thread safe, callers serialize access.
+ */
+class DirectChannel {
+public:
+    /* Maps |size| bytes of the memory behind |fd|, or returns nullptr.
+     * Takes ownership of |fd| in both cases. */
+    static std::unique_ptr<DirectChannel> create(int fd, size_t size);
+    ~DirectChannel();
+
+    /* Starts, changes or stops (RateLevel::STOP) reporting |handle|.
+     * Returns the report token the client tells the sensors apart by. */
+    int32_t configure(int handle, RateLevel rate);
+    bool isReporting(int handle) const;
+    /* Configured sampling period of |handle|, 0 if not reported */
+    int64_t periodNs(int handle) const;
+    /* Sensors reported at any rate, as SENSORS_* mask */
+    uint32_t reportedSensors() const;
+
+    /* Writes |event| unless it comes in faster than the configured rate.
+     * |now| is the arrival time of the event, in nanoseconds. */
+    void post(sensors_event_t const& event, int64_t now);
+
+private:
+    DirectChannel(int fd, uint8_t* base, size_t size);
+    DirectChannel(DirectChannel const&) = delete;
+    DirectChannel& operator=(DirectChannel const&) = delete;
+
+    void write(sensors_event_t const& event, int32_t reportToken);
+
+    int mFd;
+    uint8_t* mBase;
+    size_t mSize;
+    size_t mSlots;
+    size_t mWritePos;
+    uint32_t mCounter;
+
+    int64_t mPeriod[MAX_NUM_SENSORS];
+    int64_t mLastPosted[MAX_NUM_SENSORS];
+};
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
+
+#endif  // ANDBOX_HARDWARE_SENSORS_DIRECT_CHANNEL_H_
@@ -0,0 +1,198 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Fusion.h"
+
+#include <algorithm>
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+/* How fast the acceleration corrects gravity, in seconds. Slow while the
+ * gyroscope tracks rotations, faster when the low-pass is all there is. */
+static constexpr float kGyroTimeConstant = 0.5f;
+static constexpr float kAccelTimeConstant = 0.2f;
+/* The gyroscope counts as streaming if its last sample is this recent */
+static constexpr int64_t kGyroTimeout = 100000000LL;
+/* Longer steps are not integrated, the device turned by an unknown angle */
+static constexpr int64_t kMaxGyroStep = 100000000LL;
+/* Gravity is estimated from scratch after a gap this long */
+static constexpr int64_t kMaxAccelGap = 1000000000LL;
+/* How fast the magnetometer corrects the heading while the gyroscope
+ * tracks rotations, in seconds. Magnetometers are noisy. */
+static constexpr float kHeadingTimeConstant = 1.0f;
+/* Heading error of a fresh magnetometer fix, in radians, until the
+ * corrections show how well it holds */
+static constexpr float kInitialHeadingError = 0.5f;
+
+static bool is_recent(int64_t timestamp, int64_t last) {
+    return timestamp - last < kGyroTimeout && last - timestamp < kGyroTimeout;
+}
+
+GravityFusion::GravityFusion()
+    : mGravity{ 0.0f, 0.0f, 0.0f },
+      mValid(false),
+      mLastAccel(0),
+      mLastGyro(0) {
+}
+
+void GravityFusion::addGyro(int64_t timestamp, Vector3 const& rate) {
+    int64_t const step = timestamp - mLastGyro;
+    mLastGyro = timestamp;
+
+    if (!mValid || step <= 0 || step > kMaxGyroStep)
+        return;
+
+    /* Gravity is fixed in the world, in the device frame it turns against
+     * the rotation of the device. The first order step grows the vector a
+     * little, its length is the accelerometer's business. */
+    float const dt = step * 1e-9f;
+    float const before = length(mGravity);
+    Vector3 const turned = mGravity - cross(rate, mGravity) * dt;
+    float const after = length(turned);
+
+    if (after > 0.0f)
+        mGravity = turned * (before / after);
+}
+
+void GravityFusion::addAccel(int64_t timestamp, Vector3 const& acceleration) {
+    int64_t const step = timestamp - mLastAccel;
+
+    if (!mValid || step > kMaxAccelGap) {
+        mGravity = acceleration;
+        mValid = true;
+        mLastAccel = timestamp;
+        return;
+    }
+    if (step <= 0)
+        return;
+    mLastAccel = timestamp;
+
+    float const tau = is_recent(timestamp, mLastGyro) ? kGyroTimeConstant : kAccelTimeConstant;
+    float const dt = step * 1e-9f;
+    float const alpha = tau / (tau + dt);
+
+    mGravity = mGravity * alpha + acceleration * (1.0f - alpha);
+}
+
+OrientationFusion::OrientationFusion(bool magnetic)
+    : mRotation{ 1.0f, 0.0f, 0.0f, 0.0f },
+      mMagnetic(magnetic),
+      mTiltValid(false),
+      mHeadingValid(false),
+      mHeadingError(kInitialHeadingError),
+      mLastAccel(0),
+      mLastGyro(0),
+      mLastMag(0) {
+}
+
+bool OrientationFusion::gyroActive(int64_t timestamp) const {
+    return is_recent(timestamp, mLastGyro);
+}
+
+void OrientationFusion::correct(Vector3 const& v) {
+    mRotation = normalized(rotation_of(v) * mRotation);
+}
+
+void OrientationFusion::addGyro(int64_t timestamp, Vector3 const& rate) {
+    int64_t const step = timestamp - mLastGyro;
+    mLastGyro = timestamp;
+
+    if (!mTiltValid || step <= 0 || step > kMaxGyroStep)
+        return;
+
+    /* The rate is in device coordinates, so it turns the device side */
+    mRotation = normalized(mRotation * rotation_of(rate * (step * 1e-9f)));
+}
+
+void OrientationFusion::addAccel(int64_t timestamp, Vector3 const& acceleration) {
+    float const g = length(acceleration);
+    /* Free fall, there is no up to go by */
+    if (g < 1e-3f)
+        return;
+
+    Vector3 const up = acceleration * (1.0f / g);
+    Vector3 const worldUp = { 0.0f, 0.0f, 1.0f };
+    int64_t const step = timestamp - mLastAccel;
+
+    if (!mTiltValid || step > kMaxAccelGap) {
+        /* The shortest rotation taking |up| to the world's, upside down
+         * there is none, turn around the x axis then */
+        Vector3 const axis = cross(up, worldUp);
+        mRotation = dot(up, worldUp) > -0.9999f ?
+            normalized({ 1.0f + dot(up, worldUp), axis.x, axis.y, axis.z }) :
+            Quaternion{ 0.0f, 1.0f, 0.0f, 0.0f };
+        mTiltValid = true;
+        mHeadingValid = false;
+        mLastAccel = timestamp;
+        return;
+    }
+    if (step <= 0)
+        return;
+    mLastAccel = timestamp;
+
+    /* Turn the estimated up a fraction of the way to the measured one */
+    Vector3 const measured = rotate(mRotation, up);
+    Vector3 const axis = cross(measured, worldUp);
+    float const s = length(axis);
+    if (s < 1e-6f)
+        return;
+
+    float const tau = gyroActive(timestamp) ? kGyroTimeConstant : kAccelTimeConstant;
+    float const dt = step * 1e-9f;
+    float const angle = atan2f(s, dot(measured, worldUp)) * std::min(1.0f, dt / tau);
+    correct(axis * (angle / s));
+}
+
+void OrientationFusion::addMag(int64_t timestamp, Vector3 const& field) {
+    if (!mMagnetic || !mTiltValid)
+        return;
+
+    /* Only the horizontal part points north */
+    Vector3 const world = rotate(mRotation, field);
+    if (world.x * world.x + world.y * world.y < 1e-6f)
+        return;
+
+    /* Turning around up by the angle east of north brings it north */
+    float const heading = atan2f(world.x, world.y);
+    int64_t const step = timestamp - mLastMag;
+    float gain = 1.0f;
+    if (mHeadingValid && step <= kMaxAccelGap) {
+        if (step <= 0)
+            return;
+        float const tau = gyroActive(timestamp) ? kHeadingTimeConstant : kAccelTimeConstant;
+        gain = std::min(1.0f, step * 1e-9f / tau);
+        /* Converged, the corrections left are noise and disturbances */
+        mHeadingError += (fabsf(heading) - mHeadingError) * gain;
+    } else {
+        mHeadingError = kInitialHeadingError;
+    }
+    mLastMag = timestamp;
+    mHeadingValid = true;
+
+    correct({ 0.0f, 0.0f, heading * gain });
+}
+
+float OrientationFusion::headingAccuracy(int64_t timestamp) const {
+    if (!mMagnetic || !valid() || timestamp - mLastMag > kMaxAccelGap)
+        return -1.0f;
+    return mHeadingError;
+}
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
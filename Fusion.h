@@ -0,0 +1,178 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDBOX_HARDWARE_SENSORS_FUSION_H_
+#define ANDBOX_HARDWARE_SENSORS_FUSION_H_
+
+#include <math.h>
+#include <stdint.h>
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+struct Vector3 {
+    float x;
+    float y;
+    float z;
+};
+
+inline Vector3 operator+(Vector3 const& a, Vector3 const& b) {
+    return { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+inline Vector3 operator-(Vector3 const& a, Vector3 const& b) {
+    return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+inline Vector3 operator*(Vector3 const& v, float s) {
+    return { v.x * s, v.y * s, v.z * s };
+}
+
+inline float dot(Vector3 const& a, Vector3 const& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vector3 cross(Vector3 const& a, Vector3 const& b) {
+    return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+inline float length(Vector3 const& v) {
+    return sqrtf(dot(v, v));
+}
+
+/* A rotation, w is the real part */
+struct Quaternion {
+    float w;
+    float x;
+    float y;
+    float z;
+};
+
+inline Quaternion operator*(Quaternion const& a, Quaternion const& b) {
+    return { a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z,
+             a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+             a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+             a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w };
+}
+
+inline Quaternion normalized(Quaternion const& q) {
+    float const n = 1.0f / sqrtf(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+    return { q.w * n, q.x * n, q.y * n, q.z * n };
+}
+
+/* The rotation by |length(v)| radians around |v| */
+inline Quaternion rotation_of(Vector3 const& v) {
+    float const angle = length(v);
+    if (angle < 1e-6f)
+        return normalized({ 1.0f, v.x * 0.5f, v.y * 0.5f, v.z * 0.5f });
+
+    float const s = sinf(angle * 0.5f) / angle;
+    return { cosf(angle * 0.5f), v.x * s, v.y * s, v.z * s };
+}
+
+/* |v| rotated by the unit quaternion |q| */
+inline Vector3 rotate(Quaternion const& q, Vector3 const& v) {
+    Vector3 const u = { q.x, q.y, q.z };
+    Vector3 const t = cross(u, v) * 2.0f;
+    return v + t * q.w + cross(u, t);
+}
+
+/*
+ * Gravity in the device frame, from the accelerometer and, while it is
+ * streaming, the gyroscope.
+ *
+ * A complementary filter: the gyroscope turns the estimate along with
+ * the device, the accelerometer pulls it back slowly so gyroscope drift
+ * can't build up. Without gyroscope samples it is a low-pass filter of
+ * the acceleration.
+ *
+ * Both inputs are stamped in nanoseconds on the same clock. The estimate
+ * starts over from the next acceleration after a gap in the samples,
+ * e.g. when the sensors using it were off for a while.
+ */
+class GravityFusion {
+public:
+    GravityFusion();
+
+    /* Angular rate in rad/s */
+    void addGyro(int64_t timestamp, Vector3 const& rate);
+    /* Acceleration in m/s^2 */
+    void addAccel(int64_t timestamp, Vector3 const& acceleration);
+
+    /* In m/s^2, valid from the first acceleration on */
+    Vector3 const& gravity() const { return mGravity; }
+
+private:
+    Vector3 mGravity;
+    bool mValid;
+    int64_t mLastAccel;
+    int64_t mLastGyro;
+};
+
+/*
+ * Orientation of the device relative to east-north-up, for the rotation
+ * vector sensors.
+ *
+ * The gyroscope turns the estimate along with the device. The
+ * accelerometer corrects its tilt and, if |magnetic|, the magnetometer
+ * its heading, each a fraction of the error per sample so that noise and
+ * linear acceleration average out. Fed without gyroscope it follows the
+ * corrections alone. Without magnetometer the heading is wherever the
+ * gyroscope took it, which is what a game rotation vector is.
+ *
+ * Inputs are stamped in nanoseconds on the same clock. After a gap in
+ * the accelerometer samples the estimate starts over from the next one.
+ */
+class OrientationFusion {
+public:
+    explicit OrientationFusion(bool magnetic);
+
+    /* Angular rate in rad/s */
+    void addGyro(int64_t timestamp, Vector3 const& rate);
+    /* Acceleration in m/s^2 */
+    void addAccel(int64_t timestamp, Vector3 const& acceleration);
+    /* Magnetic field in any unit */
+    void addMag(int64_t timestamp, Vector3 const& field);
+
+    /* Whether rotation() is an estimate yet */
+    bool valid() const { return mTiltValid && (mHeadingValid || !mMagnetic); }
+    /* Rotates device coordinates into east-north-up ones */
+    Quaternion const& rotation() const { return mRotation; }
+    /* Estimated heading error in radians, -1 without a recent magnetometer */
+    float headingAccuracy(int64_t timestamp) const;
+
+private:
+    bool gyroActive(int64_t timestamp) const;
+    /* Turns the estimate by |v| around the world axes */
+    void correct(Vector3 const& v);
+
+    Quaternion mRotation;
+    bool mMagnetic;
+    bool mTiltValid;
+    bool mHeadingValid;
+    /* Average heading correction the magnetometer asked for */
+    float mHeadingError;
+    int64_t mLastAccel;
+    int64_t mLastGyro;
+    int64_t mLastMag;
+};
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
+
+#endif  // ANDBOX_HARDWARE_SENSORS_FUSION_H_
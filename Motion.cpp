@@ -0,0 +1,90 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Motion.h"
+
+#include <bitset>
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+/* Span of one classified window */
+static constexpr int64_t kMotionWindow = 1000000000LL;
+/* Summed variances of the acceleration, in (m/s^2)^2. Below the first
+ * the device lies on something, above the second it is moved, above the
+ * third it is walked or driven with. */
+static constexpr float kStillVariance = 0.005f;
+static constexpr float kMovingVariance = 0.05f;
+static constexpr float kSignificantVariance = 1.0f;
+/* Windows in a row for stationary and moving */
+static constexpr unsigned kDetectWindows = 5;
+/* Of the last kSignificantHistory windows, how many must move
+ * significantly */
+static constexpr unsigned kSignificantHistory = 8;
+static constexpr unsigned kSignificantWindows = 6;
+
+MotionDetector::MotionDetector()
+    : mVariance(kMotionWindow),
+      mLast(0),
+      mStillWindows(0),
+      mMovingWindows(0),
+      mSignificant(0) {
+}
+
+bool MotionDetector::add(int64_t timestamp, Vector3 const& acceleration) {
+    /* The windows restart after a gap, and so does what they tell */
+    if (timestamp - mLast > kMotionWindow || timestamp < mLast) {
+        mStillWindows = 0;
+        mMovingWindows = 0;
+        mSignificant = 0;
+    }
+    mLast = timestamp;
+
+    if (!mVariance.add(timestamp, acceleration))
+        return false;
+
+    float const variance = mVariance.variance();
+    mStillWindows = variance < kStillVariance ? mStillWindows + 1 : 0;
+    mMovingWindows = variance > kMovingVariance ? mMovingWindows + 1 : 0;
+    mSignificant = ((mSignificant << 1) | (variance > kSignificantVariance)) &
+                   ((1U << kSignificantHistory) - 1);
+    return true;
+}
+
+void MotionDetector::reset() {
+    mVariance.reset();
+    mLast = 0;
+    mStillWindows = 0;
+    mMovingWindows = 0;
+    mSignificant = 0;
+}
+
+bool MotionDetector::stationary() const {
+    return mStillWindows >= kDetectWindows;
+}
+
+bool MotionDetector::moving() const {
+    return mMovingWindows >= kDetectWindows;
+}
+
+bool MotionDetector::significantMotion() const {
+    return std::bitset<kSignificantHistory>(mSignificant).count() >= kSignificantWindows;
+}
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
@@ -0,0 +1,72 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDBOX_HARDWARE_SENSORS_MOTION_H_
+#define ANDBOX_HARDWARE_SENSORS_MOTION_H_
+
+#include <stdint.h>
+
+#include "Calibration.h"
+#include "Fusion.h"
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+/*
+ * Tells from the accelerometer whether the device lies still, moves or
+ * is carried along, for a motion detector.
+ *
+ * Each second of samples is classified by the variance of the
+ * acceleration, and the recent classes are kept in counters and a few
+ * bits. Constant time and space per sample, the sampling rate only has
+ * to be high enough to see a step.
+ *
+ * Inputs are stamped in nanoseconds. After a gap in the samples the
+ * detector starts over.
+ */
+class MotionDetector {
+public:
+    MotionDetector();
+
+    /* Acceleration in m/s^2. Returns whether it completed a second, i.e.
+     * whether the state below may have changed. */
+    bool add(int64_t timestamp, Vector3 const& acceleration);
+    /* Forgets all samples so far, for a detector that gets activated */
+    void reset();
+
+    /* Still for the last five seconds */
+    bool stationary() const;
+    /* Moving for the last five seconds */
+    bool moving() const;
+    /* Moving like walking or riding for most of the last eight seconds,
+     * which picking the device up isn't */
+    bool significantMotion() const;
+
+private:
+    WindowedVariance mVariance;
+    int64_t mLast;
+    unsigned mStillWindows;
+    unsigned mMovingWindows;
+    /* One bit per recent window, set if it moved significantly */
+    uint32_t mSignificant;
+};
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
+
+#endif  // ANDBOX_HARDWARE_SENSORS_MOTION_H_
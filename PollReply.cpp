@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PollReply.h"
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+void hidl_vec_write(GBinderWriter* writer, const void* data,
+                    guint count, guint elemsize) {
+    GBinderHidlVec* vec = gbinder_writer_new0(writer, GBinderHidlVec);
+    GBinderParent parent;
+
+    vec->data.ptr = data;
+    vec->count = count;
+    vec->owns_buffer = TRUE;
+
+    parent.index = gbinder_writer_append_buffer_object(writer, vec, sizeof(*vec));
+    parent.offset = GBINDER_HIDL_VEC_BUFFER_OFFSET;
+    gbinder_writer_append_buffer_object_with_parent(writer, data,
+        count * elemsize, &parent);
+}
+
+sensors_event_t* poll_reply_alloc_events(GBinderWriter* writer, size_t capacity) {
+    if (!capacity)
+        return NULL;
+
+    return (sensors_event_t*) gbinder_writer_malloc(writer,
+        capacity * sizeof(sensors_event_t));
+}
+
+void poll_reply_write(GBinderWriter* writer, int err,
+                      const sensors_event_t* events, size_t count) {
+    gbinder_writer_append_int32(writer, err);
+    hidl_vec_write(writer, events, count, sizeof(*events));
+    /* No dynamic sensors */
+    hidl_vec_write(writer, NULL, 0, sizeof(sensor_t));
+}
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
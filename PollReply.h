@@ -0,0 +1,46 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ANDBOX_HARDWARE_SENSORS_POLL_REPLY_H_
+#define ANDBOX_HARDWARE_SENSORS_POLL_REPLY_H_
+
+#include <gbinder.h>
+
+#include "hybrisbindertypes.h"
+
+namespace waydroid {
+namespace sensors {
+namespace implementation {
+
+/* Writes a hidl_vec of |count| elements at |data|, which must outlive the
+ * reply. An empty vector still carries its (empty) data buffer. */
+void hidl_vec_write(GBinderWriter* writer, const void* data,
+                    guint count, guint elemsize);
+
+/* Room for |capacity| events, freed along with the reply of |writer|.
+ * POLL drains the event rings straight into it. */
+sensors_event_t* poll_reply_alloc_events(GBinderWriter* writer, size_t capacity);
+
+/* Writes the POLL reply: |err|, the first |count| of |events| and no
+ * dynamic sensors. */
+void poll_reply_write(GBinderWriter* writer, int err,
+                      const sensors_event_t* events, size_t count);
+
+}  // namespace implementation
+}  // namespace sensors
+}  // namespace waydroid
+
+#endif  // ANDBOX_HARDWARE_SENSORS_POLL_REPLY_H_
@@ -17,7 +17,10 @@
  */
 
 #include "SensorFW.h"
+#include "SensorTable.h"
 #include <gio/gio.h>
+#include <algorithm>
+#include <utility>
 #include <iostream>
 
 namespace waydroid {
@@ -31,170 +34,149 @@ std::string the_dbus_bus_address()
 	return address ? address.get() : std::string{};
 }
 
-SensorFW::SensorFW()
-    : data(nullptr) {
-    std::string dbus_address = the_dbus_bus_address();
-    data = g_new0(SensorData, 1);
-
-    try {
-        data->accelerometer_sensor = std::make_shared<waydroid::core::SensorfwAccelerometerSensor>(dbus_address);
-        data->sensorAvailable[ID_ACCELEROMETER] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwAccelerometerSensor: %s", e.what());
-        data->sensorAvailable[ID_ACCELEROMETER] = FALSE;
-    }
-    try {
-        data->gyroscope_sensor = std::make_shared<waydroid::core::SensorfwGyroscopeSensor>(dbus_address);
-        data->sensorAvailable[ID_GYROSCOPE] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwGyroscopeSensor: %s", e.what());
-        data->sensorAvailable[ID_GYROSCOPE] = FALSE;
-    }
-    try {
-        data->humidity_sensor = std::make_shared<waydroid::core::SensorfwHumiditySensor>(dbus_address);
-        data->sensorAvailable[ID_HUMIDITY] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwHumiditySensor: %s", e.what());
-        data->sensorAvailable[ID_HUMIDITY] = FALSE;
-    }
-    try {
-        data->light_sensor = std::make_shared<waydroid::core::SensorfwLightSensor>(dbus_address);
-        data->sensorAvailable[ID_LIGHT] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwLightSensor: %s", e.what());
-        data->sensorAvailable[ID_LIGHT] = FALSE;
-    }
-    try {
-        data->magnetometer_sensor = std::make_shared<waydroid::core::SensorfwMagnetometerSensor>(dbus_address);
-        data->sensorAvailable[ID_MAGNETIC_FIELD] = TRUE;
-        data->sensorAvailable[ID_MAGNETIC_FIELD_UNCALIBRATED] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwMagnetometerSensor: %s", e.what());
-        data->sensorAvailable[ID_MAGNETIC_FIELD] = FALSE;
-        data->sensorAvailable[ID_MAGNETIC_FIELD_UNCALIBRATED] = FALSE;
+/* Number of threads serving all sensorfw channels, WAYDROID_SENSORS_REACTOR_THREADS */
+static size_t the_reactor_thread_count()
+{
+    const char* env = getenv("WAYDROID_SENSORS_REACTOR_THREADS");
+    if (!env)
+        return 1;
+
+    unsigned long count = strtoul(env, nullptr, 10);
+    if (count < 1 || count > NUM_SENSORFW_SENSORS) {
+        GWARN("Ignoring WAYDROID_SENSORS_REACTOR_THREADS=%s", env);
+        return 1;
     }
-    try {
-        data->orientation_sensor = std::make_shared<waydroid::core::SensorfwOrientationSensor>(dbus_address);
-        data->sensorAvailable[ID_DEVICE_ORIENTATION] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwOrientationSensor: %s", e.what());
-        data->sensorAvailable[ID_DEVICE_ORIENTATION] = FALSE;
+    return count;
+}
+
+/* Per-handle operations on sensorfw, generated from SensorTraits */
+struct SensorOps {
+    /* Handle whose channel serves this one */
+    int channel;
+    std::future<void> (*probe)(SensorData *d,
+        std::shared_ptr<waydroid::core::DBusConnectionHandle> const &dbus,
+        waydroid::core::EventLoop &loop);
+    waydroid::core::HandlerRegistration (*subscribe)(SensorData *d,
+        SensorSink const *sink);
+    void (*enable)(SensorData *d);
+    void (*disable)(SensorData *d);
+    waydroid::core::Sensorfw* (*plugin)(SensorData *d);
+};
+
+template<int Id, bool = SensorChannel<Id>::value == Id>
+struct ChannelOps {
+    typedef SensorTraits<Id> Traits;
+    typedef typename Traits::Sample Sample;
+
+    static std::future<void> probe(SensorData *d,
+            std::shared_ptr<waydroid::core::DBusConnectionHandle> const &dbus,
+            waydroid::core::EventLoop &loop) {
+        auto &plugin = Traits::plugin(d);
+        plugin = std::make_shared<typename Traits::Plugin>(dbus, loop);
+        return plugin->probe();
     }
-    try {
-        data->pressure_sensor = std::make_shared<waydroid::core::SensorfwPressureSensor>(dbus_address);
-        data->sensorAvailable[ID_PRESSURE] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwPressureSensor: %s", e.what());
-        data->sensorAvailable[ID_PRESSURE] = FALSE;
+
+    static waydroid::core::HandlerRegistration subscribe(SensorData *d,
+            SensorSink const *sink) {
+        return Traits::plugin(d)->register_sink(&ChannelOps::convert,
+                                                const_cast<SensorSink*>(sink));
     }
-    try {
-        data->proximity_sensor = std::make_shared<waydroid::core::SensorfwProximitySensor>(dbus_address);
-        data->sensorAvailable[ID_PROXIMITY] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwProximitySensor: %s", e.what());
-        data->sensorAvailable[ID_PROXIMITY] = FALSE;
+
+    /* Runs on the event loop of the channel */
+    static void convert(void *userdata, waydroid::core::SampleSpan<Sample> values) {
+        auto const sink = static_cast<SensorSink const*>(userdata);
+        sensors_event_t events[kMaxEventsPerSample];
+
+        for (auto const &value : values) {
+            size_t const count = Traits::convert(value, events);
+            sink->cb(sink->userdata, Id, value.timestamp_, events, count);
+        }
+        sink->wake(sink->userdata);
     }
+
+    static void enable(SensorData *d) { Traits::plugin(d)->enable_events(); }
+    static void disable(SensorData *d) { Traits::plugin(d)->disable_events(); }
+    static waydroid::core::Sensorfw* plugin(SensorData *d) { return Traits::plugin(d).get(); }
+};
+
+/* Handles served by the channel of another handle */
+template<int Id>
+struct ChannelOps<Id, false> : ChannelOps<SensorChannel<Id>::value> {};
+
+template<int... Ids>
+static const SensorOps* make_sensor_ops(std::integer_sequence<int, Ids...>) {
+    static const SensorOps ops[] = {
+        { SensorChannel<Ids>::value,
+          &ChannelOps<Ids>::probe,
+          &ChannelOps<Ids>::subscribe,
+          &ChannelOps<Ids>::enable,
+          &ChannelOps<Ids>::disable,
+          &ChannelOps<Ids>::plugin }...
+    };
+    return ops;
+}
+
+/* Indexed by sensor handle */
+static const SensorOps* const kSensorOps =
+    make_sensor_ops(std::make_integer_sequence<int, NUM_SENSORFW_SENSORS>());
+
+static bool is_channel(int id) {
+    return kSensorOps[id].channel == id;
+}
+
+SensorFW::SensorFW()
+    : mSink(), data(nullptr) {
+    data = g_new0(SensorData, 1);
+
+    /* One system bus connection shared by every sensorfw plugin */
+    std::shared_ptr<waydroid::core::DBusConnectionHandle> dbus_connection;
     try {
-        data->stepcounter_sensor = std::make_shared<waydroid::core::SensorfwStepcounterSensor>(dbus_address);
-        data->sensorAvailable[ID_STEPCOUNTER] = TRUE;
+        dbus_connection = std::make_shared<waydroid::core::DBusConnectionHandle>(
+            the_dbus_bus_address());
     } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwStepcounterSensor: %s", e.what());
-        data->sensorAvailable[ID_STEPCOUNTER] = FALSE;
+        GERR("Failed to connect to sensorfw: %s", e.what());
+        return;
     }
-    try {
-        data->temperature_sensor = std::make_shared<waydroid::core::SensorfwTemperatureSensor>(dbus_address);
-        data->sensorAvailable[ID_TEMPERATURE] = TRUE;
-    } catch (std::exception const &e) {
-        GINFO("Failed to create SensorfwTemperatureSensor: %s", e.what());
-        data->sensorAvailable[ID_TEMPERATURE] = FALSE;
+
+    mEventLoops = std::make_shared<waydroid::core::EventLoopPool>(
+        "sensorfw", the_reactor_thread_count());
+    GINFO("Serving sensorfw channels from %zu thread(s)", mEventLoops->size());
+
+    /* Probe all plugins in parallel, it only takes as long as the slowest.
+     * Sessions are only requested once a sensor gets activated. */
+    std::future<void> pending[NUM_SENSORFW_SENSORS];
+
+    for (int id = 0; id < NUM_SENSORFW_SENSORS; id++)
+        if (is_channel(id))
+            pending[id] = kSensorOps[id].probe(data, dbus_connection, mEventLoops->next());
+
+    for (int id = 0; id < NUM_SENSORFW_SENSORS; id++) {
+        if (!pending[id].valid())
+            continue;
+        try {
+            pending[id].get();
+            data->sensorAvailable[id] = TRUE;
+        } catch (std::exception const &e) {
+            GINFO("Failed to probe %s sensor: %s", _SensorIdToName(id), e.what());
+            data->sensorAvailable[id] = FALSE;
+        }
     }
+    for (int id = 0; id < NUM_SENSORFW_SENSORS; id++)
+        data->sensorAvailable[id] = data->sensorAvailable[kSensorOps[id].channel];
 }
 
-void SensorFW::RegisterSensors(sensor_event_cb_t cb, void *userdata) {
-    if (data->sensorAvailable[ID_ACCELEROMETER]) {
-        mRegistrations.push_back(
-            data->accelerometer_sensor->register_accelerometer_handler(
-                [this, cb, userdata](AccelerationData value) {
-                    this->data->accelerometer_event = value;
-                    cb(userdata, ID_ACCELEROMETER);
-                }));
-    }
-    if (data->sensorAvailable[ID_GYROSCOPE]) {
-        mRegistrations.push_back(
-            data->gyroscope_sensor->register_gyroscope_handler(
-                [this, cb, userdata](TimedXyzData value) {
-                    this->data->gyroscope_event = value;
-                    cb(userdata, ID_GYROSCOPE);
-                }));
-    }
-    if (data->sensorAvailable[ID_HUMIDITY]) {
-        mRegistrations.push_back(
-            data->humidity_sensor->register_humidity_handler(
-                [this, cb, userdata](TimedUnsigned value) {
-                    this->data->humidity_event = value;
-                    cb(userdata, ID_HUMIDITY);
-                }));
-    }
-    if (data->sensorAvailable[ID_LIGHT]) {
-        mRegistrations.push_back(
-            data->light_sensor->register_light_handler(
-                [this, cb, userdata](TimedUnsigned value) {
-                    this->data->light_event = value;
-                    cb(userdata, ID_LIGHT);
-                }));
-    }
-    if (data->sensorAvailable[ID_MAGNETIC_FIELD]) {
-        mRegistrations.push_back(
-            data->magnetometer_sensor->register_magnetometer_handler(
-                [this, cb, userdata](CalibratedMagneticFieldData value) {
-                    this->data->magnetometer_event = value;
-                    cb(userdata, ID_MAGNETIC_FIELD);
-                }));
-    }
-    if (data->sensorAvailable[ID_DEVICE_ORIENTATION]) {
-        mRegistrations.push_back(
-            data->orientation_sensor->register_orientation_handler(
-                [this, cb, userdata](PoseData value) {
-                    this->data->orientation_event = value;
-                    cb(userdata, ID_DEVICE_ORIENTATION);
-                }));
-    }
-    if (data->sensorAvailable[ID_PRESSURE]) {
-        mRegistrations.push_back(
-            data->pressure_sensor->register_pressure_handler(
-                [this, cb, userdata](TimedUnsigned value) {
-                    this->data->pressure_event = value;
-                    cb(userdata, ID_PRESSURE);
-                }));
-    }
-    if (data->sensorAvailable[ID_PROXIMITY]) {
-        mRegistrations.push_back(
-            data->proximity_sensor->register_proximity_handler(
-                [this, cb, userdata](ProximityData value) {
-                    this->data->proximity_event = value;
-                    cb(userdata, ID_PROXIMITY);
-                }));
-    }
-    if (data->sensorAvailable[ID_STEPCOUNTER]) {
-        mRegistrations.push_back(
-            data->stepcounter_sensor->register_stepcounter_handler(
-                [this, cb, userdata](TimedUnsigned value) {
-                    this->data->stepcounter_event = value;
-                    cb(userdata, ID_STEPCOUNTER);
-                }));
-    }
-    if (data->sensorAvailable[ID_TEMPERATURE]) {
-        mRegistrations.push_back(
-            data->temperature_sensor->register_temperature_handler(
-                [this, cb, userdata](TimedUnsigned value) {
-                    this->data->temperature_event = value;
-                    cb(userdata, ID_TEMPERATURE);
-                }));
-    }
+void SensorFW::RegisterSensors(sensor_event_cb_t cb, sensor_wake_cb_t wake, void *userdata) {
+    mSink.cb = cb;
+    mSink.wake = wake;
+    mSink.userdata = userdata;
+
+    for (int id = 0; id < NUM_SENSORFW_SENSORS; id++)
+        if (is_channel(id) && data->sensorAvailable[id])
+            mRegistrations.push_back(kSensorOps[id].subscribe(data, &mSink));
 }
 
 bool SensorFW::IsSensorAvailable(int id) {
-    if (id >= MAX_NUM_SENSORS)
+    if (id >= NUM_SENSORFW_SENSORS)
         return false;
 
     return data->sensorAvailable[id];
@@ -211,45 +193,15 @@ int SensorFW::EnableSensorEvents(int id) {
     if (!IsSensorAvailable(id))
         return -ENODEV;
 
-    switch (id) {
-    case ID_ACCELEROMETER:
-        data->accelerometer_sensor->enable_accelerometer_events();
-        break;
-    case ID_GYROSCOPE:
-        data->gyroscope_sensor->enable_gyroscope_events();
-        break;
-    case ID_HUMIDITY:
-        data->humidity_sensor->enable_humidity_events();
-        break;
-    case ID_LIGHT:
-        data->light_sensor->enable_light_events();
-        break;
-    case ID_MAGNETIC_FIELD:
-        data->magnetometer_sensor->enable_magnetometer_events();
-        break;
-    case ID_MAGNETIC_FIELD_UNCALIBRATED:
-        data->magnetometer_sensor->enable_magnetometer_events();
-        break;
-    case ID_DEVICE_ORIENTATION:
-        data->orientation_sensor->enable_orientation_events();
-        break;
-    case ID_PRESSURE:
-        data->pressure_sensor->enable_pressure_events();
-        break;
-    case ID_PROXIMITY:
-        data->proximity_sensor->enable_proximity_events();
-        break;
-    case ID_STEPCOUNTER:
-        data->stepcounter_sensor->enable_stepcounter_events();
-        break;
-    case ID_TEMPERATURE:
-        data->temperature_sensor->enable_temperature_events();
-        break;
-    default:
-        return -EINVAL;
-        break;
+    /* The sensorfw session is requested on first use and that can fail */
+    try {
+        kSensorOps[id].enable(data);
+    } catch (std::exception const& e) {
+        GERR("Failed to enable sensor %d: %s", id, e.what());
+        return -EIO;
     }
     data->sensorEventEnable[id] = TRUE;
+    ApplyInterval(id);
 
     return 0;
 }
@@ -258,174 +210,66 @@ int SensorFW::DisableSensorEvents(int id) {
     if (!IsSensorAvailable(id))
         return -ENODEV;
 
-    switch (id) {
-    case ID_ACCELEROMETER:
-        data->accelerometer_sensor->disable_accelerometer_events();
-        break;
-    case ID_GYROSCOPE:
-        data->gyroscope_sensor->disable_gyroscope_events();
-        break;
-    case ID_HUMIDITY:
-        data->humidity_sensor->disable_humidity_events();
-        break;
-    case ID_LIGHT:
-        data->light_sensor->disable_light_events();
-        break;
-    case ID_MAGNETIC_FIELD:
-        data->magnetometer_sensor->disable_magnetometer_events();
-        break;
-    case ID_MAGNETIC_FIELD_UNCALIBRATED:
-        data->magnetometer_sensor->disable_magnetometer_events();
-        break;
-    case ID_DEVICE_ORIENTATION:
-        data->orientation_sensor->disable_orientation_events();
-        break;
-    case ID_PRESSURE:
-        data->pressure_sensor->disable_pressure_events();
-        break;
-    case ID_PROXIMITY:
-        data->proximity_sensor->disable_proximity_events();
-        break;
-    case ID_STEPCOUNTER:
-        data->stepcounter_sensor->disable_stepcounter_events();
-        break;
-    case ID_TEMPERATURE:
-        data->temperature_sensor->disable_temperature_events();
-        break;
-    default:
-        return -EINVAL;
-        break;
-    }
     data->sensorEventEnable[id] = FALSE;
 
-    return 0;
-}
-
-int SensorFW::GetAccelerometerEvent(uint64_t *ts, int *x, int *y, int *z) {
-    if (!IsSensorEventEnable(ID_ACCELEROMETER))
-        return -EPERM;
+    /* Handles sharing a channel share its sensorfw session */
+    if (IsChannelInUse(id)) {
+        ApplyInterval(id);
+        return 0;
+    }
 
-    *ts = data->accelerometer_event.timestamp_;
-    *x = data->accelerometer_event.x_;
-    *y = data->accelerometer_event.y_;
-    *z = data->accelerometer_event.z_;
+    kSensorOps[id].disable(data);
 
     return 0;
 }
 
-int SensorFW::GetGyroscopeEvent(uint64_t *ts, int *x, int *y, int *z) {
-    if (!IsSensorEventEnable(ID_GYROSCOPE))
-        return -EPERM;
+int SensorFW::SetSensorInterval(int id, int64_t periodUs) {
+    if (!IsSensorAvailable(id))
+        return -ENODEV;
 
-    *ts = data->gyroscope_event.timestamp_;
-    *x = data->gyroscope_event.x_;
-    *y = data->gyroscope_event.y_;
-    *z = data->gyroscope_event.z_;
+    /* No period leaves the rate to sensord */
+    data->intervalMs[id] = periodUs > 0 ? std::max<int64_t>(1, (periodUs + 500) / 1000) : 0;
+    ApplyInterval(id);
 
     return 0;
 }
 
-int SensorFW::GetHumidityEvent(uint64_t *ts, unsigned *value) {
-    if (!IsSensorEventEnable(ID_HUMIDITY))
-        return -EPERM;
-
-    *ts = data->humidity_event.timestamp_;
-    *value = data->humidity_event.value_;
-
-    return 0;
+waydroid::core::Sensorfw* SensorFW::Channel(int id) {
+    return id >= 0 && id < NUM_SENSORFW_SENSORS ? kSensorOps[id].plugin(data) : nullptr;
 }
 
-int SensorFW::GetLightEvent(uint64_t *ts, unsigned *value) {
-    if (!IsSensorEventEnable(ID_LIGHT))
-        return -EPERM;
+bool SensorFW::IsChannelInUse(int id) {
+    int const channel = kSensorOps[id].channel;
 
-    *ts = data->light_event.timestamp_;
-    *value = data->light_event.value_;
+    for (int other = 0; other < NUM_SENSORFW_SENSORS; other++)
+        if (kSensorOps[other].channel == channel && data->sensorEventEnable[other])
+            return true;
 
-    return 0;
+    return false;
 }
 
-int SensorFW::GetMagnetometerEvent(uint64_t *ts, int *x, int *y, int *z,
-        int *rx, int *ry, int *rz, int *level) {
-    if (!IsSensorEventEnable(ID_MAGNETIC_FIELD) &&
-        !IsSensorEventEnable(ID_MAGNETIC_FIELD_UNCALIBRATED))
-        return -EPERM;
-
-    *ts = data->magnetometer_event.timestamp_;
-    *x = data->magnetometer_event.x_;
-    *y = data->magnetometer_event.y_;
-    *z = data->magnetometer_event.z_;
-    *rx = data->magnetometer_event.rx_;
-    *ry = data->magnetometer_event.ry_;
-    *rz = data->magnetometer_event.rz_;
-    *level = data->magnetometer_event.level_;
-
-    return 0;
-}
-
-int SensorFW::GetOrientationEvent(uint64_t *ts, int *degree) {
-    if (!IsSensorEventEnable(ID_DEVICE_ORIENTATION))
-        return -EPERM;
-
-    *ts = data->orientation_event.timestamp_;
-    switch (data->orientation_event.orientation_)
-    {
-    case PoseData::Orientation::RightUp:
-        *degree = 1;
-        break;
-    case PoseData::Orientation::BottomUp:
-        *degree = 2;
-        break;
-    case PoseData::Orientation::LeftUp:
-        *degree = 3;
-        break;
-    default:
-        *degree = 0;
-        break;
+/*
+ * Picks the rate of a sensorfw session from all handles sharing it: the
+ * fastest rate of the enabled handles, or of all of them if none is enabled.
+ * Without any rate asked for, the session goes back to the sensord default.
+ */
+void SensorFW::ApplyInterval(int id) {
+    auto const channel = Channel(id);
+    bool const in_use = IsChannelInUse(id);
+    int interval = 0;
+
+    for (int other = 0; other < NUM_SENSORFW_SENSORS; other++) {
+        if (kSensorOps[other].channel != kSensorOps[id].channel ||
+            data->intervalMs[other] <= 0)
+            continue;
+        if (in_use && !data->sensorEventEnable[other])
+            continue;
+        if (interval == 0 || data->intervalMs[other] < interval)
+            interval = data->intervalMs[other];
     }
 
-    return 0;
-}
-
-int SensorFW::GetPressureEvent(uint64_t *ts, unsigned *value) {
-    if (!IsSensorEventEnable(ID_PRESSURE))
-        return -EPERM;
-
-    *ts = data->pressure_event.timestamp_;
-    *value = data->pressure_event.value_;
-
-    return 0;
-}
-
-int SensorFW::GetProximityEvent(uint64_t *ts, unsigned *value, bool *isNear) {
-    if (!IsSensorEventEnable(ID_PROXIMITY))
-        return -EPERM;
-
-    *ts = data->proximity_event.timestamp_;
-    *value = data->proximity_event.value_;
-    *isNear = data->proximity_event.withinProximity_;
-
-    return 0;
-}
-
-int SensorFW::GetStepcounterEvent(uint64_t *ts, unsigned *value) {
-    if (!IsSensorEventEnable(ID_STEPCOUNTER))
-        return -EPERM;
-
-    *ts = data->stepcounter_event.timestamp_;
-    *value = data->stepcounter_event.value_;
-
-    return 0;
-}
-
-int SensorFW::GetTemperatureEvent(uint64_t *ts, unsigned *value) {
-    if (!IsSensorEventEnable(ID_TEMPERATURE))
-        return -EPERM;
-
-    *ts = data->temperature_event.timestamp_;
-    *value = data->temperature_event.value_;
-
-    return 0;
+    if (channel)
+        channel->request_interval(interval);
 }
 
 } // namespace waydroid
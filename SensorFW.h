@@ -19,24 +19,22 @@
 #ifndef SENSORHW_H_
 #define SENSORHW_H_
 
-#include <plugins/sensorfw_accelerometer_sensor.h>
-#include <plugins/sensorfw_gyroscope_sensor.h>
-#include <plugins/sensorfw_humidity_sensor.h>
-#include <plugins/sensorfw_light_sensor.h>
-#include <plugins/sensorfw_magnetometer_sensor.h>
-#include <plugins/sensorfw_orientation_sensor.h>
-#include <plugins/sensorfw_pressure_sensor.h>
-#include <plugins/sensorfw_proximity_sensor.h>
-#include <plugins/sensorfw_stepcounter_sensor.h>
-#include <plugins/sensorfw_temperature_sensor.h>
+#include <plugins/sensorfw_channel.h>
+#include <utils/event_loop_pool.h>
+
+#include "hybrisbindertypes.h"
 
 #include <vector>
 
 namespace waydroid {
 
-#define MAX_NUM_SENSORS 11
+#define MAX_NUM_SENSORS 20
+/* Handles below this are read from sensorfw, the others are computed by
+ * the HAL from those, see sensor_sources() */
+#define NUM_SENSORFW_SENSORS 11
 
 #define SUPPORTED_SENSORS  ((1<<MAX_NUM_SENSORS)-1)
+#define SENSORFW_SENSORS   ((1<<NUM_SENSORFW_SENSORS)-1)
 
 #define  ID_BASE                        0
 #define  ID_ACCELEROMETER               (ID_BASE+0)
@@ -50,6 +48,15 @@ namespace waydroid {
 #define  ID_PROXIMITY                   (ID_BASE+8)
 #define  ID_STEPCOUNTER                 (ID_BASE+9)
 #define  ID_TEMPERATURE                 (ID_BASE+10)
+#define  ID_GRAVITY                     (ID_BASE+11)
+#define  ID_LINEAR_ACCELERATION         (ID_BASE+12)
+#define  ID_GAME_ROTATION_VECTOR        (ID_BASE+13)
+#define  ID_ROTATION_VECTOR             (ID_BASE+14)
+#define  ID_GEOMAGNETIC_ROTATION_VECTOR (ID_BASE+15)
+#define  ID_GYROSCOPE_UNCALIBRATED      (ID_BASE+16)
+#define  ID_SIGNIFICANT_MOTION          (ID_BASE+17)
+#define  ID_STATIONARY_DETECT           (ID_BASE+18)
+#define  ID_MOTION_DETECT               (ID_BASE+19)
 
 #define  SENSORS_ACCELEROMETER                (1 << ID_ACCELEROMETER)
 #define  SENSORS_GYROSCOPE                    (1 << ID_GYROSCOPE)
@@ -62,43 +69,24 @@ namespace waydroid {
 #define  SENSORS_PROXIMITY                    (1 << ID_PROXIMITY)
 #define  SENSORS_STEPCOUNTER                  (1 << ID_STEPCOUNTER)
 #define  SENSORS_TEMPERATURE                  (1 << ID_TEMPERATURE)
+#define  SENSORS_GRAVITY                      (1 << ID_GRAVITY)
+#define  SENSORS_LINEAR_ACCELERATION          (1 << ID_LINEAR_ACCELERATION)
+#define  SENSORS_GAME_ROTATION_VECTOR         (1 << ID_GAME_ROTATION_VECTOR)
+#define  SENSORS_ROTATION_VECTOR              (1 << ID_ROTATION_VECTOR)
+#define  SENSORS_GEOMAGNETIC_ROTATION_VECTOR  (1 << ID_GEOMAGNETIC_ROTATION_VECTOR)
+#define  SENSORS_GYROSCOPE_UNCALIBRATED       (1 << ID_GYROSCOPE_UNCALIBRATED)
+#define  SENSORS_SIGNIFICANT_MOTION           (1 << ID_SIGNIFICANT_MOTION)
+#define  SENSORS_STATIONARY_DETECT            (1 << ID_STATIONARY_DETECT)
+#define  SENSORS_MOTION_DETECT                (1 << ID_MOTION_DETECT)
 
 #define  ID_CHECK(x)  ((unsigned)((x) - ID_BASE) < MAX_NUM_SENSORS)
 
-#define  SENSORS_LIST  \
-    SENSOR_(ACCELEROMETER,"accelerometer") \
-    SENSOR_(GYROSCOPE,"gyroscope") \
-    SENSOR_(HUMIDITY, "humidity") \
-    SENSOR_(LIGHT, "light") \
-    SENSOR_(MAGNETIC_FIELD,"magnetic-field") \
-    SENSOR_(MAGNETIC_FIELD_UNCALIBRATED,"magnetic-field-uncalibrated") \
-    SENSOR_(DEVICE_ORIENTATION,"device-orientation") \
-    SENSOR_(PRESSURE, "pressure") \
-    SENSOR_(PROXIMITY,"proximity") \
-    SENSOR_(STEPCOUNTER, "stepcounter") \
-    SENSOR_(TEMPERATURE,"temperature")
-
-static const struct {
-    const char*  name;
-    int          id; } _sensorIds[MAX_NUM_SENSORS] =
-{
-#define SENSOR_(x,y)  { y, ID_##x },
-    SENSORS_LIST
-#undef  SENSOR_
-};
-
-static const char* _SensorIdToName(int id) {
-    int nn;
-    for (nn = 0; nn < MAX_NUM_SENSORS; nn++)
-        if (id == _sensorIds[nn].id)
-            return _sensorIds[nn].name;
-    return "<UNKNOWN>";
-}
-
 typedef struct {
     /* General */
     gboolean sensorAvailable[MAX_NUM_SENSORS];
     gboolean sensorEventEnable[MAX_NUM_SENSORS];
+    /* Sampling period asked for by BATCH, 0 if never set */
+    int intervalMs[MAX_NUM_SENSORS];
 
     /* Sensors */
     std::shared_ptr<waydroid::core::SensorfwAccelerometerSensor> accelerometer_sensor;
@@ -111,44 +99,40 @@ typedef struct {
     std::shared_ptr<waydroid::core::SensorfwProximitySensor> proximity_sensor;
     std::shared_ptr<waydroid::core::SensorfwStepcounterSensor> stepcounter_sensor;
     std::shared_ptr<waydroid::core::SensorfwTemperatureSensor> temperature_sensor;
-
-    /* Events */
-    AccelerationData accelerometer_event;
-    TimedXyzData gyroscope_event;
-    TimedUnsigned humidity_event;
-    TimedUnsigned light_event;
-    CalibratedMagneticFieldData magnetometer_event;
-    PoseData orientation_event;
-    TimedUnsigned pressure_event;
-    ProximityData proximity_event;
-    TimedUnsigned stepcounter_event;
-    TimedUnsigned temperature_event;
 } SensorData;
 
-typedef void (*sensor_event_cb_t)(void *userdata, int id);
+/* Called once per sample of the channel of handle |id|, from its event loop,
+ * with the |count| events the sample converts to. |timestampUs| is the
+ * acquisition time on the sensord clock. */
+typedef void (*sensor_event_cb_t)(void *userdata, int id, uint64_t timestampUs,
+                                  sensors_event_t const *events, size_t count);
+/* Called once after all samples of a socket batch were passed to the event cb */
+typedef void (*sensor_wake_cb_t)(void *userdata);
+
+/* Where the converted samples of all channels go */
+struct SensorSink {
+    sensor_event_cb_t cb;
+    sensor_wake_cb_t wake;
+    void *userdata;
+};
 
 struct SensorFW {
     SensorFW();
 
-    void RegisterSensors(sensor_event_cb_t cb, void *userdata);
+    void RegisterSensors(sensor_event_cb_t cb, sensor_wake_cb_t wake, void *userdata);
     bool IsSensorAvailable(int id);
     bool IsSensorEventEnable(int id);
     int EnableSensorEvents(int id);
     int DisableSensorEvents(int id);
-
-    int GetAccelerometerEvent(uint64_t *ts, int *x, int *y, int *z);
-    int GetGyroscopeEvent(uint64_t *ts, int *x, int *y, int *z);
-    int GetHumidityEvent(uint64_t *ts, unsigned *value);
-    int GetLightEvent(uint64_t *ts, unsigned *value);
-    int GetMagnetometerEvent(uint64_t *ts, int *x, int *y, int *z,
-        int *rx, int *ry, int *rz, int* level);
-    int GetOrientationEvent(uint64_t *ts, int *degree);
-    int GetPressureEvent(uint64_t *ts, unsigned *value);
-    int GetProximityEvent(uint64_t *ts, unsigned *value, bool *isNear);
-    int GetStepcounterEvent(uint64_t *ts, unsigned *value);
-    int GetTemperatureEvent(uint64_t *ts, unsigned *value);
+    int SetSensorInterval(int id, int64_t periodUs);
 
 private:
+    waydroid::core::Sensorfw* Channel(int id);
+    bool IsChannelInUse(int id);
+    void ApplyInterval(int id);
+
+    std::shared_ptr<waydroid::core::EventLoopPool> mEventLoops;
+    SensorSink mSink;
     SensorData *data;
     std::vector<waydroid::core::HandlerRegistration> mRegistrations;
 };
@@ -0,0 +1,388 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SENSORTABLE_H_
+#define SENSORTABLE_H_
+
+#include "hybrisbindertypes.h"
+#include "SensorFW.h"
+
+namespace waydroid {
+
+/* What the HAL advertises for a sensor handle */
+struct SensorDescriptor {
+    int id;
+    /* Short name, for logs */
+    const char* tag;
+    const char* name;
+    int32_t type;
+    const char* typeAsString;
+    float maxRange;
+    float resolution;
+    float power;
+    int32_t minDelay;
+    int32_t maxDelay;
+    uint32_t flags;
+};
+
+constexpr uint32_t kContinuous = SENSOR_FLAG_DATA_INJECTION | SENSOR_FLAG_CONTINUOUS_MODE;
+constexpr uint32_t kOnChange = SENSOR_FLAG_DATA_INJECTION | SENSOR_FLAG_ON_CHANGE_MODE;
+constexpr uint32_t kOneShot = SENSOR_FLAG_ONE_SHOT_MODE;
+/* Bits of the reporting mode in the flags */
+constexpr uint32_t kReportingModeMask = 0xe;
+
+/* Indexed by sensor handle */
+constexpr SensorDescriptor kSensorTable[MAX_NUM_SENSORS] = {
+    { ID_ACCELEROMETER, "accelerometer",
+      "SensorFW 3-axis Accelerometer",
+      SENSOR_TYPE_ACCELEROMETER, "android.sensor.accelerometer",
+      39.3f, 1.0f / 4032.0f, 3.0f, 10000, 500000, kContinuous },
+    { ID_GYROSCOPE, "gyroscope",
+      "SensorFW 3-axis Gyroscope",
+      SENSOR_TYPE_GYROSCOPE, "android.sensor.gyroscope",
+      16.46f, 1.0f / 1000.0f, 3.0f, 10000, 500000, kContinuous },
+    { ID_HUMIDITY, "humidity",
+      "SensorFW Humidity sensor",
+      SENSOR_TYPE_RELATIVE_HUMIDITY, "android.sensor.relative_humidity",
+      100.0f, 1.0f, 20.0f, 0, 0, kOnChange },
+    { ID_LIGHT, "light",
+      "SensorFW Light sensor",
+      SENSOR_TYPE_LIGHT, "android.sensor.light",
+      40000.0f, 1.0f, 20.0f, 0, 0, kOnChange },
+    { ID_MAGNETIC_FIELD, "magnetic-field",
+      "SensorFW 3-axis Magnetic field sensor",
+      SENSOR_TYPE_MAGNETIC_FIELD, "android.sensor.magnetic_field",
+      2000.0f, 0.5f, 6.7f, 10000, 500000, kContinuous },
+    { ID_MAGNETIC_FIELD_UNCALIBRATED, "magnetic-field-uncalibrated",
+      "SensorFW 3-axis Magnetic field sensor (uncalibrated)",
+      SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED, "android.sensor.magnetic_field_uncalibrated",
+      2000.0f, 0.5f, 6.7f, 10000, 500000, kContinuous },
+    { ID_DEVICE_ORIENTATION, "device-orientation",
+      "SensorFW Device Orientation sensor",
+      SENSOR_TYPE_DEVICE_ORIENTATION, "android.sensor.device_orientation",
+      3.0f, 1.0f, 0.1f, 0, 0, kOnChange },
+    { ID_PRESSURE, "pressure",
+      "SensorFW Pressure sensor",
+      SENSOR_TYPE_PRESSURE, "android.sensor.pressure",
+      800.0f, 1.0f, 20.0f, 10000, 500000, kContinuous },
+    { ID_PROXIMITY, "proximity",
+      "SensorFW Proximity sensor",
+      SENSOR_TYPE_PROXIMITY, "android.sensor.proximity",
+      5.0f, 5.0f, 20.0f, 0, 0, kOnChange | SENSOR_FLAG_WAKE_UP },
+    { ID_STEPCOUNTER, "stepcounter",
+      "SensorFW Step counter sensor",
+      SENSOR_TYPE_STEP_COUNTER, "android.sensor.step_counter",
+      1.0f, 1.0f, 0.0f, 0, 0, kOnChange },
+    { ID_TEMPERATURE, "temperature",
+      "SensorFW Ambient Temperature sensor",
+      SENSOR_TYPE_AMBIENT_TEMPERATURE, "android.sensor.ambient_temperature",
+      80.0f, 1.0f, 0.0f, 0, 0, kOnChange },
+    /* Computed by the HAL, see sensor_sources() */
+    { ID_GRAVITY, "gravity",
+      "Waydroid Gravity sensor",
+      SENSOR_TYPE_GRAVITY, "android.sensor.gravity",
+      39.3f, 1.0f / 4032.0f, 6.0f, 10000, 500000, kContinuous },
+    { ID_LINEAR_ACCELERATION, "linear-acceleration",
+      "Waydroid Linear Acceleration sensor",
+      SENSOR_TYPE_LINEAR_ACCELERATION, "android.sensor.linear_acceleration",
+      39.3f, 1.0f / 4032.0f, 6.0f, 10000, 500000, kContinuous },
+    { ID_GAME_ROTATION_VECTOR, "game-rotation-vector",
+      "Waydroid Game Rotation Vector sensor",
+      SENSOR_TYPE_GAME_ROTATION_VECTOR, "android.sensor.game_rotation_vector",
+      1.0f, 1.0f / (1 << 24), 6.0f, 10000, 500000, kContinuous },
+    { ID_ROTATION_VECTOR, "rotation-vector",
+      "Waydroid Rotation Vector sensor",
+      SENSOR_TYPE_ROTATION_VECTOR, "android.sensor.rotation_vector",
+      1.0f, 1.0f / (1 << 24), 12.7f, 10000, 500000, kContinuous },
+    { ID_GEOMAGNETIC_ROTATION_VECTOR, "geomagnetic-rotation-vector",
+      "Waydroid Geomagnetic Rotation Vector sensor",
+      SENSOR_TYPE_GEOMAGNETIC_ROTATION_VECTOR, "android.sensor.geomagnetic_rotation_vector",
+      1.0f, 1.0f / (1 << 24), 9.7f, 10000, 500000, kContinuous },
+    { ID_GYROSCOPE_UNCALIBRATED, "gyroscope-uncalibrated",
+      "Waydroid 3-axis Gyroscope (uncalibrated)",
+      SENSOR_TYPE_GYROSCOPE_UNCALIBRATED, "android.sensor.gyroscope_uncalibrated",
+      16.46f, 1.0f / 1000.0f, 3.0f, 10000, 500000, kContinuous },
+    { ID_SIGNIFICANT_MOTION, "significant-motion",
+      "Waydroid Significant Motion sensor",
+      SENSOR_TYPE_SIGNIFICANT_MOTION, "android.sensor.significant_motion",
+      1.0f, 1.0f, 3.0f, -1, 0, kOneShot | SENSOR_FLAG_WAKE_UP },
+    { ID_STATIONARY_DETECT, "stationary-detect",
+      "Waydroid Stationary Detect sensor",
+      SENSOR_TYPE_STATIONARY_DETECT, "android.sensor.stationary_detect",
+      1.0f, 1.0f, 3.0f, -1, 0, kOneShot },
+    { ID_MOTION_DETECT, "motion-detect",
+      "Waydroid Motion Detect sensor",
+      SENSOR_TYPE_MOTION_DETECT, "android.sensor.motion_detect",
+      1.0f, 1.0f, 3.0f, -1, 0, kOneShot },
+};
+
+constexpr bool sensor_table_is_indexed(int i = 0) {
+    return i == MAX_NUM_SENSORS ||
+           (kSensorTable[i].id == i && sensor_table_is_indexed(i + 1));
+}
+static_assert(sensor_table_is_indexed(), "kSensorTable must be indexed by handle");
+
+static inline const char* _SensorIdToName(int id) {
+    return ID_CHECK(id) ? kSensorTable[id].tag : "<UNKNOWN>";
+}
+
+/* Starts an event of sensor |id|, the caller fills in the payload */
+static inline sensors_event_t& sensor_event_init(sensors_event_t& event, int id) {
+    memset(&event, 0, sizeof(event));
+    event.sensorHandle = id;
+    event.sensorType = kSensorTable[id].type;
+    return event;
+}
+
+/* The sensorfw handles that |id| is computed from, all of which must be
+ * available. For sensorfw sensors that is the handle itself. */
+constexpr uint32_t sensor_sources(int id) {
+    switch (id) {
+    case ID_GRAVITY:
+    case ID_LINEAR_ACCELERATION:
+        return SENSORS_ACCELEROMETER;
+    case ID_GAME_ROTATION_VECTOR:
+        return SENSORS_ACCELEROMETER | SENSORS_GYROSCOPE;
+    case ID_ROTATION_VECTOR:
+        return SENSORS_ACCELEROMETER | SENSORS_GYROSCOPE | SENSORS_MAGNETIC_FIELD;
+    case ID_GEOMAGNETIC_ROTATION_VECTOR:
+        return SENSORS_ACCELEROMETER | SENSORS_MAGNETIC_FIELD;
+    case ID_GYROSCOPE_UNCALIBRATED:
+        return SENSORS_GYROSCOPE;
+    case ID_SIGNIFICANT_MOTION:
+    case ID_STATIONARY_DETECT:
+    case ID_MOTION_DETECT:
+        return SENSORS_ACCELEROMETER;
+    default:
+        return 1U << id;
+    }
+}
+
+/* sensorfw handles that improve virtual sensor |id| when available, they
+ * are only streamed while |id| is in use. The uncalibrated gyroscope
+ * reports its bias estimate, which is learned more reliably while the
+ * accelerometer confirms the device is still. The plain gyroscope does
+ * not pull in the accelerometer, it uses it only when it streams anyway. */
+constexpr uint32_t sensor_optional_sources(int id) {
+    switch (id) {
+    case ID_GRAVITY:
+    case ID_LINEAR_ACCELERATION:
+        return SENSORS_GYROSCOPE;
+    case ID_GYROSCOPE_UNCALIBRATED:
+        return SENSORS_ACCELEROMETER;
+    default:
+        return 0;
+    }
+}
+
+/* The handles computed from or improved by sensorfw handle |source| */
+constexpr uint32_t sensor_consumers(int source) {
+    uint32_t consumers = 0;
+    for (int id = 0; id < MAX_NUM_SENSORS; id++)
+        if ((sensor_sources(id) | sensor_optional_sources(id)) & (1U << source))
+            consumers |= 1U << id;
+    return consumers;
+}
+
+/* Most events one sensorfw sample converts to */
+constexpr size_t kMaxEventsPerSample = 2;
+
+/*
+ * The sensorfw channel serving a handle. Handles sharing a channel are
+ * served by one plugin and session, and produced by the conversion of
+ * the channel's handle.
+ */
+template<int Id> struct SensorChannel { static constexpr int value = Id; };
+template<> struct SensorChannel<ID_MAGNETIC_FIELD_UNCALIBRATED> {
+    static constexpr int value = ID_MAGNETIC_FIELD;
+};
+
+/*
+ * Typed description of a sensorfw channel: the plugin serving it and how
+ * one of its samples converts to HAL events. Only defined for
+ * channel handles, see SensorChannel.
+ *
+ * convert() writes up to kMaxEventsPerSample events and returns how many,
+ * the timestamps are left for the caller.
+ */
+template<int Id> struct SensorTraits;
+
+template<> struct SensorTraits<ID_ACCELEROMETER> {
+    typedef waydroid::core::SensorfwAccelerometerSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->accelerometer_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        /* cm/s^2 */
+        auto& e = sensor_event_init(out[0], ID_ACCELEROMETER);
+        e.u.vec3.x = s.x_ / 100.0f;
+        e.u.vec3.y = s.y_ / 100.0f;
+        e.u.vec3.z = s.z_ / 100.0f;
+        e.u.vec3.status = ACCURACY_MEDIUM;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_GYROSCOPE> {
+    typedef waydroid::core::SensorfwGyroscopeSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->gyroscope_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        /* mrad/s */
+        auto& e = sensor_event_init(out[0], ID_GYROSCOPE);
+        e.u.vec3.x = s.x_ / 1000.0f;
+        e.u.vec3.y = s.y_ / 1000.0f;
+        e.u.vec3.z = s.z_ / 1000.0f;
+        e.u.vec3.status = ACCURACY_MEDIUM;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_HUMIDITY> {
+    typedef waydroid::core::SensorfwHumiditySensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->humidity_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        sensor_event_init(out[0], ID_HUMIDITY).u.scalar = s.value_;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_LIGHT> {
+    typedef waydroid::core::SensorfwLightSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->light_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        sensor_event_init(out[0], ID_LIGHT).u.scalar = s.value_;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_MAGNETIC_FIELD> {
+    typedef waydroid::core::SensorfwMagnetometerSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->magnetometer_sensor; }
+
+    /* One sample serves both magnetometer handles, calibrated first. The
+     * bias is what sensorfw's calibration took off, its level of 0 to 3
+     * maps to the accuracy. The HAL may calibrate better later on. */
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        auto& cal = sensor_event_init(out[0], ID_MAGNETIC_FIELD);
+        cal.u.vec3.x = s.x_;
+        cal.u.vec3.y = s.y_;
+        cal.u.vec3.z = s.z_;
+        cal.u.vec3.status = s.level_ < 0 ? 0 : s.level_ > 3 ? 3 : s.level_;
+
+        auto& raw = sensor_event_init(out[1], ID_MAGNETIC_FIELD_UNCALIBRATED);
+        raw.u.uncal.x = s.rx_;
+        raw.u.uncal.y = s.ry_;
+        raw.u.uncal.z = s.rz_;
+        raw.u.uncal.x_bias = s.rx_ - s.x_;
+        raw.u.uncal.y_bias = s.ry_ - s.y_;
+        raw.u.uncal.z_bias = s.rz_ - s.z_;
+        return 2;
+    }
+};
+
+template<> struct SensorTraits<ID_DEVICE_ORIENTATION> {
+    typedef waydroid::core::SensorfwOrientationSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->orientation_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        /* Quarter turns counter-clockwise from the natural orientation */
+        int rotation;
+        switch (s.orientation_) {
+        case PoseData::Orientation::RightUp:
+            rotation = 1;
+            break;
+        case PoseData::Orientation::BottomUp:
+            rotation = 2;
+            break;
+        case PoseData::Orientation::LeftUp:
+            rotation = 3;
+            break;
+        default:
+            rotation = 0;
+            break;
+        }
+        sensor_event_init(out[0], ID_DEVICE_ORIENTATION).u.scalar = rotation;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_PRESSURE> {
+    typedef waydroid::core::SensorfwPressureSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->pressure_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        sensor_event_init(out[0], ID_PRESSURE).u.scalar = s.value_;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_PROXIMITY> {
+    typedef waydroid::core::SensorfwProximitySensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->proximity_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        /* Near or far, at the advertised maxRange */
+        sensor_event_init(out[0], ID_PROXIMITY).u.scalar =
+            s.withinProximity_ ? 0 : kSensorTable[ID_PROXIMITY].maxRange;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_STEPCOUNTER> {
+    typedef waydroid::core::SensorfwStepcounterSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->stepcounter_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        sensor_event_init(out[0], ID_STEPCOUNTER).u.stepCount = s.value_;
+        return 1;
+    }
+};
+
+template<> struct SensorTraits<ID_TEMPERATURE> {
+    typedef waydroid::core::SensorfwTemperatureSensor Plugin;
+    typedef Plugin::Sample Sample;
+
+    static std::shared_ptr<Plugin>& plugin(SensorData* d) { return d->temperature_sensor; }
+
+    static size_t convert(Sample const& s, sensors_event_t* out) {
+        sensor_event_init(out[0], ID_TEMPERATURE).u.scalar = s.value_;
+        return 1;
+    }
+};
+
+}  // namespace waydroid
+
+#endif  // SENSORTABLE_H_
@@ -17,8 +17,20 @@
  */
 
 #include "Sensors.h"
+#include "SensorTable.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <climits>
+
+#include <algorithm>
 
 namespace waydroid {
 namespace sensors {
@@ -33,561 +45,746 @@ static int64_t now_ns(void) {
 
 /* Pick up one pending sensor event. On success, this returns the sensor
  * id, and sets |*event| accordingly. On failure, i.e. if there are no
- * pending events, return -EINVAL.
+ * pending events, return -EAGAIN.
+ *
+ * Events of one sensor are returned in the order they were queued, events
+ * of different sensors are merged by timestamp. A pending flush is
+ * completed as soon as every event queued before it for that sensor is
+ * gone, ahead of the events queued after it.
  *
- * Note: The device's lock must be acquired.
+ * Note: Only the POLL path may call this, it is the single consumer of
+ *       the event rings.
  */
-static int sensor_device_pick_pending_event_locked(SensorDevice *d,
-                                                   sensors_event_t* event)
+int sensor_device_pick_pending_event_locked(SensorDevice *d,
+                                            sensors_event_t* event)
 {
-    uint32_t mask = SUPPORTED_SENSORS & d->pendingSensors;
-    if (mask) {
-        uint32_t i = 31 - __builtin_clz(mask);
-        d->pendingSensors &= ~(1U << i);
-        // Copy the structure
-        *event = d->sensors[i];
-
-        if (d->sensors[i].sensorType == SENSOR_TYPE_META_DATA) {
-            if (d->flush_count[i] > 0) {
-                // Another 'flush' is queued after this one.
-                // Don't clear this event; just decrement the count.
-                (d->flush_count[i])--;
-                // And re-mark it as pending
-                d->pendingSensors |= (1U << i);
-            } else {
-                // We are done flushing
-                // sensor_event_cb() will leave
-                // the meta-data in place until we have it.
-                // Set |type| to something other than META_DATA
-                // so sensor_event_cb() can
-                // continue.
-                d->sensors[i].sensorType = SENSOR_TYPE_ACCELEROMETER;
-            }
-        } else {
+    int picked = -1;
+    int64_t oldest = INT64_MAX;
+
+    for (int i = 0; i < MAX_NUM_SENSORS; i++) {
+        const size_t *mark = d->flush_marks[i].front();
+        if (mark && (ptrdiff_t)(d->events[i].popped() - *mark) >= 0) {
+            size_t done;
+            d->flush_marks[i].pop(&done);
+            memset(event, 0, sizeof(*event));
+            event->sensorType = SENSOR_TYPE_META_DATA;
             event->sensorHandle = i;
-            //event->version = sizeof(*event);
+            event->u.meta.what = META_DATA_FLUSH_COMPLETE;
+            return i;
         }
 
-        return i;
+        const sensors_event_t *head = d->events[i].front();
+        if (!head)
+            continue;
+        if (picked < 0 || head->timestamp < oldest) {
+            picked = i;
+            oldest = head->timestamp;
+        }
     }
-    GERR("No sensor to return!!! pendingSensors=0x%08x", d->pendingSensors);
-    // we may end-up in a busy loop, slow things down, just in case.
-    usleep(1000);
-    return -EINVAL;
+
+    if (picked < 0)
+        return -EAGAIN;
+
+    d->events[picked].pop(event);
+    return picked;
 }
 
-/* Block until new sensor events are reported by the emulator, or if a
- * 'wake' command is received through the service. On succes, return 0
- * and updates the |pendingEvents| and |sensors| fields of |dev|.
- * On failure, return -errno.
+/* Check whether a POLL should return now. A sensor FIFO is due once its
+ * oldest event waited for the report latency of the sensor, once it is
+ * nearly full, or when a flush was requested. Otherwise the earliest time
+ * a FIFO becomes due is stored in |*deadline|, INT64_MAX if all are empty.
  *
- * Note: The device lock must be acquired when calling this function, and
- *       will still be held on return. However, the function releases the
- *       lock temporarily during the blocking wait.
+ * Note: Safe to call from the producer side too, it does not pop.
  */
-static void sensor_event_cb(void *userdata, int id)
+static bool sensor_device_has_due_events(SensorDevice *d, int64_t now,
+                                         int64_t *deadline)
 {
-    SensorDevice* dev = (SensorDevice*) userdata;
-    // Accumulate pending events into |events| and |new_sensors| mask
-    // until a 'sync' or 'wake' command is received. This also simplifies the
-    // code a bit.
-    uint32_t new_sensors = 0U;
-    sensors_event_t* events = dev->sensors;
-
-    int64_t event_time = -1;
-    uint64_t ts;
-    int x, y, z, rx, ry, rz, tmp;
-    unsigned value;
-    bool isNear;
-
-    // If the existing entry for this sensor is META_DATA,
-    // do not overwrite it. We can resume saving sensor
-    // values after that meta data has been received.
+    int64_t next = INT64_MAX;
+
+    for (int i = 0; i < MAX_NUM_SENSORS; i++) {
+        if (!d->flush_marks[i].empty())
+            return true;
+
+        size_t const queued = d->events[i].size();
+        if (queued == 0)
+            continue;
+
+        int64_t const latency = d->max_report_latency[i].load(std::memory_order_relaxed);
+        int64_t const due = d->batch_since[i].load(std::memory_order_relaxed) + latency;
+        if (latency <= 0 || due <= now || queued >= kEventRingHighWatermark)
+            return true;
+
+        if (due < next)
+            next = due;
+    }
+
+    if (deadline)
+        *deadline = next;
+    return false;
+}
+
+/* Wake up the POLL sleeping in sensor_device_wait_for_due_events(). Safe to
+ * call from any thread. */
+static void sensor_device_wake(SensorDevice *d)
+{
+    if (d->waiting_for_data.load(std::memory_order_acquire))
+        eventfd_write(d->wake_fd, 1);
+}
+
+/* Block until one of the sensor FIFOs is due, or killLoops() was called.
+ * A kill is consumed by the wait it ends, or by the next one unless
+ * resumeLoops() dropped it. */
+static void sensor_device_wait_for_due_events(SensorDevice *d)
+{
+    int64_t deadline = INT64_MAX;
+
+    if (sensor_device_has_due_events(d, now_ns(), &deadline))
+        return;
+
+    d->waiting_for_data.store(true, std::memory_order_release);
+    /* Re-checked after the flag is set, an event may have been queued before */
+    while (!d->killed.exchange(false, std::memory_order_acq_rel) &&
+           !sensor_device_has_due_events(d, now_ns(), &deadline)) {
+        int timeout = -1;
+        if (deadline != INT64_MAX) {
+            int64_t const wait_ms = (deadline - now_ns() + 999999) / 1000000;
+            timeout = wait_ms > 0 ? (int) std::min<int64_t>(wait_ms, INT_MAX) : 0;
+        }
+
+        struct pollfd pfd = { d->wake_fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, timeout) > 0) {
+            eventfd_t value;
+            eventfd_read(d->wake_fd, &value);
+        }
+    }
+    d->waiting_for_data.store(false, std::memory_order_release);
+}
+
+/* Most events the calibrations and the virtual sensors add to one
+ * sensorfw sample */
+static constexpr size_t kMaxUncalibratedEvents = 1;
+static constexpr size_t kMaxFusedEvents = 6;
+
+/* One-shot sensors computed from the accelerometer */
+static constexpr uint32_t kMotionDetectors =
+    SENSORS_SIGNIFICANT_MOTION | SENSORS_STATIONARY_DETECT | SENSORS_MOTION_DETECT;
+/* Accelerometer rate the motion detectors need, low enough to keep the
+ * host mostly asleep */
+static constexpr int64_t kMotionSamplingPeriodUs = 50000;
+
+/* Handles the calibrations are of use to */
+static constexpr uint32_t kGyroConsumers = waydroid::sensor_consumers(ID_GYROSCOPE);
+static constexpr uint32_t kMagConsumers =
+    waydroid::sensor_consumers(ID_MAGNETIC_FIELD) |
+    waydroid::sensor_consumers(ID_MAGNETIC_FIELD_UNCALIBRATED);
+
+/* Hand the events of one sensorfw sample taken at |t| to the direct
+ * channels and the POLL FIFOs that want them. */
+static void sensor_device_post_events(SensorDevice *dev, uint64_t ts, int64_t t,
+                                      int64_t now, sensors_event_t const *events,
+                                      size_t count)
+{
+    for (size_t n = 0; n < count; n++) {
+        int const i = events[n].sensorHandle;
+        if (ts == dev->last_TimeStamp[i])
+            continue;
+        dev->last_TimeStamp[i] = ts;
+
+        sensors_event_t event = events[n];
+        /* Timestamps of a sensor must increase */
+        event.timestamp = t > dev->last_event_time[i] ?
+            t : dev->last_event_time[i] + 1;
+        dev->last_event_time[i] = event.timestamp;
+
+        if (dev->direct_sensors.load(std::memory_order_relaxed) & (1U << i)) {
+            pthread_mutex_lock(&dev->direct_lock);
+            for (auto const& channel : dev->direct_channels)
+                channel.second->post(event, now);
+            pthread_mutex_unlock(&dev->direct_lock);
+        }
+
+        if (!(dev->active_sensors.load(std::memory_order_relaxed) & (1U << i)))
+            continue;
+        bool const first = dev->events[i].empty();
+        if (first)
+            dev->batch_since[i].store(now, std::memory_order_relaxed);
+        if (!dev->events[i].push(event))
+            GDEBUG("Event ring of %s is full, dropping sample",
+                   waydroid::_SensorIdToName(i));
+        else if (first)
+            dev->deadline_changed.store(true, std::memory_order_release);
+    }
+}
+
+static Vector3 vec3_of(sensors_event_t const &event)
+{
+    return { event.u.vec3.x, event.u.vec3.y, event.u.vec3.z };
+}
+
+static void vec3_set(sensors_event_t &event, Vector3 const &v, int8_t status)
+{
+    event.u.vec3.x = v.x;
+    event.u.vec3.y = v.y;
+    event.u.vec3.z = v.z;
+    event.u.vec3.status = status;
+}
+
+/* Whether virtual sensor |handle| is in use and due for an event at
+ * sensor time |time|. Its sources may run faster for other users.
+ *
+ * Note: The fusion lock must be held.
+ */
+static bool sensor_device_fused_due(SensorDevice *dev, uint32_t users,
+                                    int handle, int64_t time)
+{
+    if (!(users & (1U << handle)))
+        return false;
+
+    /* Allow for some jitter of the sensorfw stream */
+    int64_t const period = dev->fused_period_ns[handle].load(std::memory_order_relaxed);
+    if (time - dev->last_fused_time[handle] < period - period / 10)
+        return false;
+
+    dev->last_fused_time[handle] = time;
+    return true;
+}
+
+/* Write a rotation vector event of |handle| to |out| if it is due */
+static size_t sensor_device_emit_rotation(SensorDevice *dev, uint32_t users,
+                                          int handle, int64_t time,
+                                          OrientationFusion const &fusion,
+                                          sensors_event_t *out)
+{
+    if (!fusion.valid() || !sensor_device_fused_due(dev, users, handle, time))
+        return 0;
+
+    /* q and -q are the same rotation, Android wants w >= 0 */
+    Quaternion const &q = fusion.rotation();
+    float const sign = q.w < 0.0f ? -1.0f : 1.0f;
+    Vec4 &v = waydroid::sensor_event_init(*out, handle).u.vec4;
+    v.x = q.x * sign;
+    v.y = q.y * sign;
+    v.z = q.z * sign;
+    v.w = q.w * sign;
+    /* Only the rotation vectors with a magnetometer know their heading */
+    if (handle != ID_GAME_ROTATION_VECTOR)
+        out->u.data[4] = fusion.headingAccuracy(time);
+    return 1;
+}
+
+/* Accuracy of a magnetometer calibration off by |error|, relative */
+static int8_t magnetic_accuracy(float error)
+{
+    if (error < 0.03f)
+        return ACCURACY_HIGH;
+    if (error < 0.06f)
+        return ACCURACY_MEDIUM;
+    if (error < 0.12f)
+        return ACCURACY_LOW;
+    return UNRELIABLE;
+}
+
+/* Replace the calibration sensorfw gave one magnetometer sample with the
+ * HAL's own where that fits better, in both events of the sample.
+ *
+ * Note: The fusion lock must be held.
+ */
+static void sensor_device_calibrate_magnetometer(SensorDevice *dev, sensors_event_t &cal,
+                                                 sensors_event_t &uncal)
+{
+    Uncal &u = uncal.u.uncal;
+    Vector3 const raw = { u.x, u.y, u.z };
+    MagneticCalibration &calibration = dev->magnetic_calibration;
+
+    calibration.add(raw);
+    if (!calibration.calibrated())
+        return;
+
+    int8_t const accuracy = magnetic_accuracy(calibration.fitError());
+    if (accuracy < cal.u.vec3.status)
+        return;
+
+    /* Soft iron is corrected in both, like a factory calibration */
+    Vector3 const scaled = calibration.scale(raw);
+    Vector3 const &bias = calibration.bias();
+    u.x = scaled.x;
+    u.y = scaled.y;
+    u.z = scaled.z;
+    u.x_bias = bias.x;
+    u.y_bias = bias.y;
+    u.z_bias = bias.z;
+    vec3_set(cal, scaled - bias, accuracy);
+}
+
+/* Copy the events one sample of channel |id| converted to to |out|, with
+ * the estimated sensor errors taken out, followed by the uncalibrated
+ * events that are due. Returns the number of events written. |ts| is on
+ * the sensord clock, which all channels share. */
+static size_t sensor_device_calibrate(SensorDevice *dev, uint32_t users, int id,
+                                      uint64_t ts, sensors_event_t const *events,
+                                      size_t count, sensors_event_t *out)
+{
+    int64_t const time = (int64_t)ts * 1000;
+    size_t produced = count;
 
+    std::copy(events, events + count, out);
+
+    pthread_mutex_lock(&dev->fusion_lock);
     switch (id) {
-        case ID_ACCELEROMETER:
-            if (dev->mSensorFWDevice->GetAccelerometerEvent(&ts, &x, &y, &z) == 0) {
-                if (ts != dev->last_TimeStamp[ID_ACCELEROMETER]) {
-                    new_sensors |= SENSORS_ACCELEROMETER;
-                    events[ID_ACCELEROMETER].u.vec3.x = x / 100.00f;
-                    events[ID_ACCELEROMETER].u.vec3.y = y / 100.00f;
-                    events[ID_ACCELEROMETER].u.vec3.z = z / 100.00f;
-                    events[ID_ACCELEROMETER].u.vec3.status = ACCURACY_MEDIUM;
-                    events[ID_ACCELEROMETER].sensorType = SENSOR_TYPE_ACCELEROMETER;
-                    dev->last_TimeStamp[ID_ACCELEROMETER] = ts;
-                }
-            }
-            break;
+    case ID_ACCELEROMETER:
+        dev->gyro_bias.addAccel(time, vec3_of(out[0]));
+        break;
+
+    case ID_GYROSCOPE: {
+        sensors_event_t &event = out[0];
+        Vector3 const raw = vec3_of(event);
+        dev->gyro_bias.addGyro(time, raw);
+
+        Vector3 const bias = dev->gyro_bias.bias();
+        int8_t const status = dev->gyro_bias.calibrated() ?
+            (int8_t)ACCURACY_HIGH : event.u.vec3.status;
+        vec3_set(event, raw - bias, status);
+
+        if (sensor_device_fused_due(dev, users, ID_GYROSCOPE_UNCALIBRATED, time)) {
+            Uncal &uncal = waydroid::sensor_event_init(
+                out[produced++], ID_GYROSCOPE_UNCALIBRATED).u.uncal;
+            uncal.x = raw.x;
+            uncal.y = raw.y;
+            uncal.z = raw.z;
+            uncal.x_bias = bias.x;
+            uncal.y_bias = bias.y;
+            uncal.z_bias = bias.z;
+        }
+        break;
+    }
+
+    case ID_MAGNETIC_FIELD:
+        /* Both handles, as SensorTraits converted them */
+        if (count == 2)
+            sensor_device_calibrate_magnetometer(dev, out[0], out[1]);
+        break;
+    }
+    pthread_mutex_unlock(&dev->fusion_lock);
+
+    return produced;
+}
+
+/* Write the event of one-shot sensor |handle| to |out| if it is in use
+ * and |detected|, and add it to |fired| */
+static size_t sensor_device_emit_one_shot(uint32_t users, int handle, bool detected,
+                                          sensors_event_t *out, uint32_t *fired)
+{
+    if (!detected || !(users & (1U << handle)))
+        return 0;
+
+    waydroid::sensor_event_init(*out, handle).u.scalar = 1.0f;
+    *fired |= 1U << handle;
+    return 1;
+}
+
+/* The state of motion detector |handle| */
+static MotionDetector &sensor_device_motion_detector(SensorDevice *dev, int handle)
+{
+    switch (handle) {
+    case ID_SIGNIFICANT_MOTION:
+        return dev->significant_motion;
+    case ID_STATIONARY_DETECT:
+        return dev->stationary_detect;
+    default:
+        return dev->motion_detect;
+    }
+}
+
+/* Feed the events of one sensorfw sample to the virtual sensors in use
+ * and write the events they compute from it to |out|. One-shot sensors
+ * that fired are added to |fired|. |ts| is on the sensord clock, which
+ * all channels share. */
+static size_t sensor_device_fuse(SensorDevice *dev, uint32_t users, uint64_t ts,
+                                 sensors_event_t const *events, size_t count,
+                                 sensors_event_t *out, uint32_t *fired)
+{
+    uint32_t const fused = SENSORS_GRAVITY | SENSORS_LINEAR_ACCELERATION |
+                           SENSORS_GAME_ROTATION_VECTOR | SENSORS_ROTATION_VECTOR |
+                           SENSORS_GEOMAGNETIC_ROTATION_VECTOR | kMotionDetectors;
+    if (!(users & fused))
+        return 0;
+
+    uint32_t const gravity = SENSORS_GRAVITY | SENSORS_LINEAR_ACCELERATION;
+    int64_t const time = (int64_t)ts * 1000;
+    size_t produced = 0;
+
+    pthread_mutex_lock(&dev->fusion_lock);
+    for (size_t n = 0; n < count; n++) {
+        sensors_event_t const &event = events[n];
+        Vector3 const v = vec3_of(event);
+
+        switch (event.sensorHandle) {
         case ID_GYROSCOPE:
-            if (dev->mSensorFWDevice->GetGyroscopeEvent(&ts, &x, &y, &z) == 0) {
-                if (ts != dev->last_TimeStamp[ID_GYROSCOPE]) {
-                    new_sensors |= SENSORS_GYROSCOPE;
-                    events[ID_GYROSCOPE].u.vec3.x = x / 1000.000f;
-                    events[ID_GYROSCOPE].u.vec3.y = y / 1000.000f;
-                    events[ID_GYROSCOPE].u.vec3.z = z / 1000.000f;
-                    events[ID_GYROSCOPE].u.vec3.status = ACCURACY_MEDIUM;
-                    events[ID_GYROSCOPE].sensorType = SENSOR_TYPE_GYROSCOPE;
-                    dev->last_TimeStamp[ID_GYROSCOPE] = ts;
-                }
-            }
-            break;
-        case ID_HUMIDITY:
-            if (dev->mSensorFWDevice->GetHumidityEvent(&ts, &value) == 0) {
-                if (ts != dev->last_TimeStamp[ID_HUMIDITY]) {
-                    new_sensors |= SENSORS_HUMIDITY;
-                    events[ID_HUMIDITY].u.scalar = value;
-                    events[ID_HUMIDITY].sensorType = SENSOR_TYPE_RELATIVE_HUMIDITY;
-                    dev->last_TimeStamp[ID_HUMIDITY] = ts;
-                }
+            if (users & gravity)
+                dev->gravity.addGyro(time, v);
+            if (users & SENSORS_GAME_ROTATION_VECTOR) {
+                dev->game_orientation.addGyro(time, v);
+                produced += sensor_device_emit_rotation(dev, users, ID_GAME_ROTATION_VECTOR,
+                                                        time, dev->game_orientation,
+                                                        &out[produced]);
             }
-            break;
-        case ID_LIGHT:
-            if (dev->mSensorFWDevice->GetLightEvent(&ts, &value) == 0) {
-                if (ts != dev->last_TimeStamp[ID_LIGHT]) {
-                    new_sensors |= SENSORS_LIGHT;
-                    events[ID_LIGHT].u.scalar = value;
-                    events[ID_LIGHT].sensorType = SENSOR_TYPE_LIGHT;
-                    dev->last_TimeStamp[ID_LIGHT] = ts;
-                }
+            if (users & SENSORS_ROTATION_VECTOR) {
+                dev->orientation.addGyro(time, v);
+                produced += sensor_device_emit_rotation(dev, users, ID_ROTATION_VECTOR,
+                                                        time, dev->orientation,
+                                                        &out[produced]);
             }
             break;
-        case ID_MAGNETIC_FIELD:
-            if (dev->mSensorFWDevice->GetMagnetometerEvent(&ts, &x, &y, &z, &rx, &ry, &rz, &tmp) == 0) {
-                if (ts != dev->last_TimeStamp[ID_MAGNETIC_FIELD]) {
-                    new_sensors |= SENSORS_MAGNETIC_FIELD;
-                    events[ID_MAGNETIC_FIELD].u.vec3.x = x;
-                    events[ID_MAGNETIC_FIELD].u.vec3.y = y;
-                    events[ID_MAGNETIC_FIELD].u.vec3.z = z;
-                    events[ID_MAGNETIC_FIELD].u.vec3.status = ACCURACY_HIGH;
-                    events[ID_MAGNETIC_FIELD].sensorType = SENSOR_TYPE_MAGNETIC_FIELD;
-                    dev->last_TimeStamp[ID_MAGNETIC_FIELD] = ts;
-                }
-                if (ts != dev->last_TimeStamp[ID_MAGNETIC_FIELD_UNCALIBRATED]) {
-                    new_sensors |= SENSORS_MAGNETIC_FIELD_UNCALIBRATED;
-                    events[ID_MAGNETIC_FIELD_UNCALIBRATED].u.vec3.x = rx;
-                    events[ID_MAGNETIC_FIELD_UNCALIBRATED].u.vec3.y = ry;
-                    events[ID_MAGNETIC_FIELD_UNCALIBRATED].u.vec3.z = rz;
-                    events[ID_MAGNETIC_FIELD_UNCALIBRATED].u.vec3.status = ACCURACY_HIGH;
-                    events[ID_MAGNETIC_FIELD_UNCALIBRATED].sensorType = SENSOR_TYPE_MAGNETIC_FIELD;
-                    dev->last_TimeStamp[ID_MAGNETIC_FIELD_UNCALIBRATED] = ts;
-                }
+
+        case ID_ACCELEROMETER:
+            if (users & gravity) {
+                dev->gravity.addAccel(time, v);
+
+                Vector3 const g = dev->gravity.gravity();
+                if (sensor_device_fused_due(dev, users, ID_GRAVITY, time))
+                    vec3_set(waydroid::sensor_event_init(out[produced++], ID_GRAVITY),
+                             g, event.u.vec3.status);
+                if (sensor_device_fused_due(dev, users, ID_LINEAR_ACCELERATION, time))
+                    vec3_set(waydroid::sensor_event_init(out[produced++], ID_LINEAR_ACCELERATION),
+                             v - g, event.u.vec3.status);
             }
-            break;
-        case ID_DEVICE_ORIENTATION:
-            if (dev->mSensorFWDevice->GetOrientationEvent(&ts, &tmp) == 0) {
-                if (ts != dev->last_TimeStamp[ID_DEVICE_ORIENTATION]) {
-                    new_sensors |= SENSORS_DEVICE_ORIENTATION;
-                    events[ID_DEVICE_ORIENTATION].u.scalar = tmp;
-                    events[ID_DEVICE_ORIENTATION].sensorType = SENSOR_TYPE_DEVICE_ORIENTATION;
-                    dev->last_TimeStamp[ID_DEVICE_ORIENTATION] = ts;
-                }
+            if (users & SENSORS_GAME_ROTATION_VECTOR)
+                dev->game_orientation.addAccel(time, v);
+            if (users & SENSORS_ROTATION_VECTOR)
+                dev->orientation.addAccel(time, v);
+            if (users & SENSORS_GEOMAGNETIC_ROTATION_VECTOR) {
+                dev->geomagnetic_orientation.addAccel(time, v);
+                produced += sensor_device_emit_rotation(dev, users, ID_GEOMAGNETIC_ROTATION_VECTOR,
+                                                        time, dev->geomagnetic_orientation,
+                                                        &out[produced]);
             }
-            break;
-        case ID_PRESSURE:
-            if (dev->mSensorFWDevice->GetPressureEvent(&ts, &value) == 0) {
-                if (ts != dev->last_TimeStamp[ID_PRESSURE]) {
-                    new_sensors |= SENSORS_PRESSURE;
-                    events[ID_PRESSURE].u.scalar = value;
-                    events[ID_PRESSURE].sensorType = SENSOR_TYPE_PRESSURE;
-                    dev->last_TimeStamp[ID_PRESSURE] = ts;
-                }
+            if ((users & SENSORS_SIGNIFICANT_MOTION) && dev->significant_motion.add(time, v)) {
+                produced += sensor_device_emit_one_shot(users, ID_SIGNIFICANT_MOTION,
+                                                        dev->significant_motion.significantMotion(),
+                                                        &out[produced], fired);
             }
-            break;
-        case ID_PROXIMITY:
-            if (dev->mSensorFWDevice->GetProximityEvent(&ts, &value, &isNear) == 0) {
-                if (ts != dev->last_TimeStamp[ID_PROXIMITY]) {
-                    new_sensors |= SENSORS_PROXIMITY;
-                    events[ID_PROXIMITY].u.scalar = isNear ? 0 : 5;
-                    events[ID_PROXIMITY].sensorType = SENSOR_TYPE_PROXIMITY;
-                    dev->last_TimeStamp[ID_PROXIMITY] = ts;
-                }
+            if ((users & SENSORS_STATIONARY_DETECT) && dev->stationary_detect.add(time, v)) {
+                produced += sensor_device_emit_one_shot(users, ID_STATIONARY_DETECT,
+                                                        dev->stationary_detect.stationary(),
+                                                        &out[produced], fired);
             }
-            break;
-        case ID_STEPCOUNTER:
-            if (dev->mSensorFWDevice->GetStepcounterEvent(&ts, &value) == 0) {
-                if (ts != dev->last_TimeStamp[ID_STEPCOUNTER]) {
-                    new_sensors |= SENSORS_STEPCOUNTER;
-                    events[ID_STEPCOUNTER].u.stepCount = value;
-                    events[ID_STEPCOUNTER].sensorType = SENSOR_TYPE_STEP_COUNTER;
-                    dev->last_TimeStamp[ID_STEPCOUNTER] = ts;
-                }
+            if ((users & SENSORS_MOTION_DETECT) && dev->motion_detect.add(time, v)) {
+                produced += sensor_device_emit_one_shot(users, ID_MOTION_DETECT,
+                                                        dev->motion_detect.moving(),
+                                                        &out[produced], fired);
             }
             break;
-        case ID_TEMPERATURE:
-            if (dev->mSensorFWDevice->GetTemperatureEvent(&ts, &value) == 0) {
-                if (ts != dev->last_TimeStamp[ID_TEMPERATURE]) {
-                    new_sensors |= SENSORS_TEMPERATURE;
-                    events[ID_TEMPERATURE].u.scalar = value;
-                    events[ID_TEMPERATURE].sensorType = SENSOR_TYPE_AMBIENT_TEMPERATURE;
-                    dev->last_TimeStamp[ID_TEMPERATURE] = ts;
-                }
-            }
-            break;
-        default:
+
+        case ID_MAGNETIC_FIELD:
+            if (users & SENSORS_ROTATION_VECTOR)
+                dev->orientation.addMag(time, v);
+            if (users & SENSORS_GEOMAGNETIC_ROTATION_VECTOR)
+                dev->geomagnetic_orientation.addMag(time, v);
             break;
+        }
     }
+    pthread_mutex_unlock(&dev->fusion_lock);
 
-    if (new_sensors) {
-        /* update the time of each new sensor event. */
-        dev->pendingSensors |= new_sensors;
-        int64_t t = (event_time < 0) ? 0 : event_time * 1000LL;
-
-        /* Use the time at the first "sync:" as the base for later
-         * time values.
-         * CTS tests require sensors to return an event timestamp (sync) that is
-         * strictly before the time of the event arrival. We don't actually have
-         * a time syncronization protocol here, and the only data point is the
-         * "sync:" timestamp - which is an emulator's timestamp of a clock that
-         * is synced with the guest clock, and it only the timestamp after all
-         * events were sent.
-         * To make it work, let's compare the calculated timestamp with current
-         * time and take the lower value - we don't believe in events from the
-         * future anyway.
-         */
-        const int64_t now = now_ns();
-
-        if (dev->timeStart == 0) {
-            dev->timeStart  = now;
-            dev->timeOffset = dev->timeStart - t;
-        }
-        t += dev->timeOffset;
-        if (t > now) {
-            t = now;
-        }
+    return produced;
+}
+
+/* Queue the events one sensorfw sample of channel |id| converted to,
+ * calibrated, and those the virtual sensors compute from it, for POLL and
+ * the direct channels that want them. Runs on the event loop of the
+ * channel.
+ */
+void sensor_event_cb(void *userdata, int id, uint64_t ts,
+                     sensors_event_t const *events, size_t count)
+{
+    SensorDevice* dev = (SensorDevice*) userdata;
+
+    /* sensorfw stamps samples with the sensord monotonic clock in
+     * microseconds. Map that to CLOCK_BOOTTIME to report when a sample
+     * was taken rather than when it got here.
+     * CTS tests require sensors to return an event timestamp that is
+     * strictly before the time of the event arrival, we don't believe in
+     * events from the future anyway.
+     */
+    const int64_t now = now_ns();
+    int64_t t = dev->clock_sync[id].to_local((int64_t)ts * 1000, now);
+    if (t > now) {
+        t = now;
+    }
+
+    uint32_t const users = dev->active_sensors.load(std::memory_order_relaxed) |
+                           dev->direct_sensors.load(std::memory_order_relaxed);
+
+    /* Only pay for the calibrations while they are of use */
+    sensors_event_t calibrated[waydroid::kMaxEventsPerSample + kMaxUncalibratedEvents];
+    if (((id == ID_GYROSCOPE || id == ID_ACCELEROMETER) && (users & kGyroConsumers)) ||
+        (id == ID_MAGNETIC_FIELD && (users & kMagConsumers))) {
+        count = sensor_device_calibrate(dev, users, id, ts, events, count, calibrated);
+        events = calibrated;
+    }
+
+    sensor_device_post_events(dev, ts, t, now, events, count);
+
+    sensors_event_t fused[kMaxFusedEvents];
+    uint32_t fired = 0;
+    size_t const fusedCount = sensor_device_fuse(dev, users, ts, events, count, fused, &fired);
+    if (fusedCount)
+        sensor_device_post_events(dev, ts, t, now, fused, fusedCount);
+
+    /* One-shot sensors turn off once they reported. Starting and
+     * stopping streams is up to POLL, it must not block the event loop. */
+    if (fired) {
+        dev->active_sensors.fetch_and(~fired, std::memory_order_relaxed);
+        dev->fired_sensors.fetch_or(fired, std::memory_order_release);
+    }
+}
+
+/* Whether all sensorfw sensors |handle| is computed from are there */
+static bool sensor_device_is_available(SensorDevice *d, int handle)
+{
+    uint32_t const required = waydroid::sensor_sources(handle);
+
+    for (int i = 0; i < NUM_SENSORFW_SENSORS; i++)
+        if ((required & (1U << i)) && !d->mSensorFWDevice->IsSensorAvailable(i))
+            return false;
+
+    return true;
+}
+
+/* Start or stop the stream of sensorfw handle |source| as needed by POLL,
+ * the direct channels and the virtual sensors computed from it, at the
+ * fastest rate any of them in use asked for.
+ *
+ * Note: The device lock must be held.
+ */
+static int sensor_device_update_source_locked(SensorDevice *d, int source)
+{
+    SensorFW *fw = d->mSensorFWDevice;
+    uint32_t const users = d->active_sensors | d->direct_sensors;
+    bool wanted = false;
+    int64_t period = 0;
+
+    for (int h = 0; h < MAX_NUM_SENSORS; h++) {
+        uint32_t const sources = waydroid::sensor_sources(h) |
+                                 waydroid::sensor_optional_sources(h);
+        if (!(sources & (1U << source)))
+            continue;
+
+        /* Rates asked for by handles not in use are stale */
+        if (!(users & (1U << h)))
+            continue;
+        wanted = true;
+
+        for (int64_t const p : { d->batch_period_us[h], d->direct_period_us[h] })
+            if (p > 0 && (period <= 0 || p < period))
+                period = p;
+    }
+
+    if (wanted && !fw->IsSensorEventEnable(source)) {
+        if (fw->EnableSensorEvents(source) < 0)
+            return RESULT_INVALID_OPERATION;
+    } else if (!wanted && fw->IsSensorEventEnable(source)) {
+        fw->DisableSensorEvents(source);
+    }
+
+    /* Also when the last user with a rate left, so the old rate doesn't
+     * stick around for the others */
+    fw->SetSensorInterval(source, period);
+
+    return RESULT_OK;
+}
 
-        while (new_sensors) {
-            uint32_t i = 31 - __builtin_clz(new_sensors);
-            new_sensors &= ~(1U << i);
-            dev->sensors[i].timestamp = t;
+/* Bring the sensorfw streams |handle| is computed from in line with its
+ * users. Only failing to start a required stream is an error.
+ *
+ * Note: The device lock must be held.
+ */
+static int sensor_device_update_locked(SensorDevice *d, int handle)
+{
+    uint32_t const required = waydroid::sensor_sources(handle);
+    uint32_t const optional = waydroid::sensor_optional_sources(handle);
+
+    /* Virtual sensors report at their own rate, whatever their sources
+     * run at for other users */
+    if (handle >= NUM_SENSORFW_SENSORS) {
+        uint32_t const bit = 1U << handle;
+        int64_t period = d->active_sensors & bit ? d->batch_period_us[handle] : 0;
+        if ((d->direct_sensors & bit) && d->direct_period_us[handle] > 0 &&
+            (period <= 0 || d->direct_period_us[handle] < period))
+            period = d->direct_period_us[handle];
+        d->fused_period_ns[handle].store(period * 1000, std::memory_order_relaxed);
+    }
+
+    for (int i = 0; i < NUM_SENSORFW_SENSORS; i++) {
+        if (!(required & (1U << i)))
+            continue;
+        int const result = sensor_device_update_source_locked(d, i);
+        if (result != RESULT_OK)
+            return result;
+    }
+
+    for (int i = 0; i < NUM_SENSORFW_SENSORS; i++)
+        if ((optional & (1U << i)) && d->mSensorFWDevice->IsSensorAvailable(i))
+            sensor_device_update_source_locked(d, i);
+
+    return RESULT_OK;
+}
+
+/* Recompute which sensors the direct channels report and how fast, then
+ * update the sensorfw streams that changed.
+ *
+ * Note: The device lock must be held.
+ */
+static void sensor_device_update_direct_locked(SensorDevice *d)
+{
+    uint32_t sensors = 0;
+    int64_t period_us[MAX_NUM_SENSORS] = {};
+
+    pthread_mutex_lock(&d->direct_lock);
+    for (auto const& channel : d->direct_channels) {
+        sensors |= channel.second->reportedSensors();
+        for (int i = 0; i < MAX_NUM_SENSORS; i++) {
+            int64_t const period = channel.second->periodNs(i) / 1000;
+            if (period > 0 && (period_us[i] == 0 || period < period_us[i]))
+                period_us[i] = std::max<int64_t>(period, d->min_delay[i]);
         }
     }
-    if (dev->waiting_for_data)
-        g_main_loop_quit(dev->loop);
+    pthread_mutex_unlock(&d->direct_lock);
+
+    uint32_t const changed = d->direct_sensors.exchange(sensors) ^ sensors;
+    for (int i = 0; i < MAX_NUM_SENSORS; i++) {
+        if (!(changed & (1U << i)) && period_us[i] == d->direct_period_us[i])
+            continue;
+        d->direct_period_us[i] = period_us[i];
+        sensor_device_update_locked(d, i);
+    }
+}
+
+/* Stop the sensorfw streams that only ran for one-shot sensors which
+ * fired since the last call. */
+static void sensor_device_retire_fired(SensorDevice *d)
+{
+    uint32_t const fired = d->fired_sensors.exchange(0, std::memory_order_acquire);
+    if (!fired)
+        return;
+
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < MAX_NUM_SENSORS; i++)
+        if (fired & (1U << i))
+            sensor_device_update_locked(d, i);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Wake up a POLL waiting for data, once per batch of queued events, as
+ * soon as one of the sensor FIFOs is due. A batched FIFO that just got its
+ * first event is not due yet, but the POLL has to learn its deadline, it
+ * may sleep without any. */
+void sensor_wake_cb(void *userdata)
+{
+    SensorDevice* dev = (SensorDevice*) userdata;
+
+    bool const rearm = dev->deadline_changed.exchange(false, std::memory_order_acq_rel);
+    if (dev->waiting_for_data.load(std::memory_order_acquire) &&
+        (rearm || sensor_device_has_due_events(dev, now_ns(), nullptr)))
+        sensor_device_wake(dev);
+}
+
+/* The body of POLL: waits until a FIFO is due and moves up to |bufferSize|
+ * events into |events|. Returns the number of events written. */
+size_t sensor_device_poll(SensorDevice *d, sensors_event_t *events,
+                          size_t bufferSize)
+{
+    size_t count = 0;
+
+    sensor_device_wait_for_due_events(d);
+
+    /* Now read as many pending events as needed, once one FIFO is due
+     * the others are delivered along with it to save a round trip. */
+    while (count < bufferSize &&
+           sensor_device_pick_pending_event_locked(d, &events[count]) >= 0)
+        count++;
+
+    sensor_device_retire_fired(d);
+
+    return count;
 }
 
 Sensors::Sensors()
     : mSensorDevice(nullptr) {
-    mSensorDevice = (SensorDevice *) malloc(sizeof(*mSensorDevice));
-    memset(mSensorDevice, 0, sizeof(*mSensorDevice));
-
-    // (sensorType == SENSOR_TYPE_META_DATA) is
-    // sticky. Don't start off with that setting.
-    for (int idx = 0; idx < MAX_NUM_SENSORS; idx++) {
-        mSensorDevice->sensors[idx].sensorType = SENSOR_TYPE_ACCELEROMETER;
-        mSensorDevice->flush_count[idx] = 0;
-    }
+    mSensorDevice = new SensorDevice();
 
     mSensorDevice->mSensorFWDevice = new SensorFW();
-    mSensorDevice->mSensorFWDevice->RegisterSensors(sensor_event_cb, mSensorDevice);
+    mSensorDevice->mSensorFWDevice->RegisterSensors(sensor_event_cb, sensor_wake_cb, mSensorDevice);
 
     pthread_mutex_init(&mSensorDevice->lock, NULL);
-    mSensorDevice->loop = g_main_loop_new(NULL, TRUE);
+    pthread_mutex_init(&mSensorDevice->direct_lock, NULL);
+    pthread_mutex_init(&mSensorDevice->fusion_lock, NULL);
+    pthread_mutex_init(&mSensorDevice->flush_lock, NULL);
+    mSensorDevice->next_direct_channel = 1;
+    mSensorDevice->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    mSensorsList = buildSensorsList();
+    for (auto const& sensor_info : mSensorsList) {
+        mSensorDevice->min_delay[sensor_info.handle] = sensor_info.minDelay;
+        mSensorDevice->max_delay[sensor_info.handle] = sensor_info.maxDelay;
+    }
+
+    /* BATCH doesn't set a rate for one-shot sensors, the motion detectors
+     * run the accelerometer at one of their own */
+    for (int i = 0; i < MAX_NUM_SENSORS; i++)
+        if (kMotionDetectors & (1U << i))
+            mSensorDevice->batch_period_us[i] = kMotionSamplingPeriodUs;
 }
 
-std::vector<sensor_t> Sensors::getSensorsList() {
+std::vector<sensor_t> const& Sensors::getSensorsList() const {
+    return mSensorsList;
+}
+
+static void hidl_string_init(gbinder_hidl_string *str, const char *value) {
+    str->data.str = value;
+    str->len = strlen(value);
+    str->owns_buffer = TRUE;
+}
+
+std::vector<sensor_t> Sensors::buildSensorsList() {
     std::vector<sensor_t> out_vector;
 
-    int sensors_count = 0;
-    
-    for (int id = 0; id < MAX_NUM_SENSORS; id++) {
-        if(!mSensorDevice->mSensorFWDevice->IsSensorAvailable(id)) {
-            GERR("Sensor %s Not found!", waydroid::_SensorIdToName(id));
+    for (auto const& desc : waydroid::kSensorTable) {
+        if (!sensor_device_is_available(mSensorDevice, desc.id)) {
+            GERR("Sensor %s Not found!", desc.tag);
             continue;
         }
+
         sensor_t sensor_info;
-        sensor_info.handle = id;
-        switch (id)
-        {
-        case ID_ACCELEROMETER:
-            sensor_info.name.data.str = "SensorFW 3-axis Accelerometer";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_ACCELEROMETER;
-            sensor_info.typeAsString.data.str = "android.sensor.accelerometer";
-            sensor_info.maxRange = 39.3;
-            sensor_info.resolution = 1.0 / 4032.0;
-            sensor_info.power = 3.0;
-            sensor_info.minDelay = 10000;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 500000;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_CONTINUOUS_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_GYROSCOPE:
-            sensor_info.name.data.str = "SensorFW 3-axis Gyroscope";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_GYROSCOPE;
-            sensor_info.typeAsString.data.str = "android.sensor.gyroscope";
-            sensor_info.maxRange = 16.46;
-            sensor_info.resolution = 1.0 / 1000.0;
-            sensor_info.power = 3.0;
-            sensor_info.minDelay = 10000;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 500000;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_CONTINUOUS_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_HUMIDITY:
-            sensor_info.name.data.str = "SensorFW Humidity sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_RELATIVE_HUMIDITY;
-            sensor_info.typeAsString.data.str = "android.sensor.relative_humidity";
-            sensor_info.maxRange = 100.0;
-            sensor_info.resolution = 1.0;
-            sensor_info.power = 20.0;
-            sensor_info.minDelay = 0;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 0;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_ON_CHANGE_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_LIGHT:
-            sensor_info.name.data.str = "SensorFW Light sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_LIGHT;
-            sensor_info.typeAsString.data.str = "android.sensor.light";
-            sensor_info.maxRange = 40000.0;
-            sensor_info.resolution = 1.0;
-            sensor_info.power = 20.0;
-            sensor_info.minDelay = 0;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 0;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_ON_CHANGE_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_MAGNETIC_FIELD:
-            sensor_info.name.data.str = "SensorFW 3-axis Magnetic field sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_MAGNETIC_FIELD;
-            sensor_info.typeAsString.data.str = "android.sensor.magnetic_field";
-            sensor_info.maxRange = 2000.0;
-            sensor_info.resolution = .5;
-            sensor_info.power = 6.7;
-            sensor_info.minDelay = 10000;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 500000;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_CONTINUOUS_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_MAGNETIC_FIELD_UNCALIBRATED:
-            sensor_info.name.data.str = "SensorFW 3-axis Magnetic field sensor (uncalibrated)";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED;
-            sensor_info.typeAsString.data.str = "android.sensor.magnetic_field_uncalibrated";
-            sensor_info.maxRange = 2000.0;
-            sensor_info.resolution = 0.5;
-            sensor_info.power = 6.7;
-            sensor_info.minDelay = 10000;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 500000;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_CONTINUOUS_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_DEVICE_ORIENTATION:
-            sensor_info.name.data.str = "SensorFW Device Orientation sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_DEVICE_ORIENTATION;
-            sensor_info.typeAsString.data.str = "android.sensor.device_orientation";
-            sensor_info.maxRange = 3.0;
-            sensor_info.resolution = 1.0;
-            sensor_info.power = 0.1;
-            sensor_info.minDelay = 0;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 0;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_ON_CHANGE_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_PRESSURE:
-            sensor_info.name.data.str = "SensorFW Pressure sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_PRESSURE;
-            sensor_info.typeAsString.data.str = "android.sensor.pressure";
-            sensor_info.maxRange = 800.0;
-            sensor_info.resolution = 1.0;
-            sensor_info.power = 20.0;
-            sensor_info.minDelay = 10000;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 500000;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_CONTINUOUS_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_PROXIMITY:
-            sensor_info.name.data.str = "SensorFW Proximity sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_PROXIMITY;
-            sensor_info.typeAsString.data.str = "android.sensor.proximity";
-            sensor_info.maxRange = 5.0;
-            sensor_info.resolution = 5.0;
-            sensor_info.power = 20.0;
-            sensor_info.minDelay = 0;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 0;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_ON_CHANGE_MODE |
-                                SENSOR_FLAG_WAKE_UP;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_STEPCOUNTER:
-            sensor_info.name.data.str = "SensorFW Step counter sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_STEP_COUNTER;
-            sensor_info.typeAsString.data.str = "android.sensor.step_counter";
-            sensor_info.maxRange = 1.0;
-            sensor_info.resolution = 1.0;
-            sensor_info.power = 0.0;
-            sensor_info.minDelay = 0;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 0;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_ON_CHANGE_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;
-            out_vector.push_back(sensor_info);
-            break;
-        case ID_TEMPERATURE:
-            sensor_info.name.data.str = "SensorFW Ambient Temperature sensor";
-            sensor_info.vendor.data.str = kWaydroidVendor;
-            sensor_info.version = 1;
-            sensor_info.type = SENSOR_TYPE_AMBIENT_TEMPERATURE;
-            sensor_info.typeAsString.data.str = "android.sensor.ambient_temperature";
-            sensor_info.maxRange = 80.0;
-            sensor_info.resolution = 1.0;
-            sensor_info.power = 0.0;
-            sensor_info.minDelay = 0;
-            sensor_info.fifoReservedEventCount = 0;
-            sensor_info.fifoMaxEventCount = 0;
-            sensor_info.requiredPermission.data.str = "";
-            sensor_info.maxDelay = 0;
-            sensor_info.flags = SENSOR_FLAG_DATA_INJECTION |
-                                SENSOR_FLAG_ON_CHANGE_MODE;
-            sensor_info.name.len = strlen(sensor_info.name.data.str);
-            sensor_info.name.owns_buffer = TRUE;
-            sensor_info.vendor.len = strlen(sensor_info.vendor.data.str);
-            sensor_info.vendor.owns_buffer = TRUE;
-            sensor_info.typeAsString.len = strlen(sensor_info.typeAsString.data.str);
-            sensor_info.typeAsString.owns_buffer = TRUE;
-            sensor_info.requiredPermission.len = strlen(sensor_info.requiredPermission.data.str);
-            sensor_info.requiredPermission.owns_buffer = TRUE;    
-            out_vector.push_back(sensor_info);
-            break;
-        default:
-            break;
-        }
+        sensor_info.handle = desc.id;
+        hidl_string_init(&sensor_info.name, desc.name);
+        hidl_string_init(&sensor_info.vendor, kWaydroidVendor);
+        sensor_info.version = 1;
+        sensor_info.type = desc.type;
+        hidl_string_init(&sensor_info.typeAsString, desc.typeAsString);
+        sensor_info.maxRange = desc.maxRange;
+        sensor_info.resolution = desc.resolution;
+        sensor_info.power = desc.power;
+        sensor_info.minDelay = desc.minDelay;
+        /* One-shot sensors can't batch */
+        bool const one_shot = (desc.flags & waydroid::kReportingModeMask) ==
+                              SENSOR_FLAG_ONE_SHOT_MODE;
+        sensor_info.fifoReservedEventCount = one_shot ? 0 : kEventRingSize;
+        sensor_info.fifoMaxEventCount = one_shot ? 0 : kEventRingSize;
+        hidl_string_init(&sensor_info.requiredPermission, "");
+        sensor_info.maxDelay = desc.maxDelay;
+        sensor_info.flags = desc.flags;
+        out_vector.push_back(sensor_info);
+    }
+
+    /* Continuous sensors can be reported through direct channels, at the
+     * fastest rate level their minDelay allows for */
+    for (auto& sensor_info : out_vector) {
+        RateLevel const level = direct_report_max_rate(sensor_info.minDelay);
+        if (level == RateLevel::STOP)
+            continue;
+
+        sensor_info.flags |= SENSOR_FLAG_DIRECT_CHANNEL_ASHMEM |
+                             ((uint32_t)level << SENSOR_FLAG_SHIFT_DIRECT_REPORT);
     }
 
     return out_vector;
@@ -602,70 +799,103 @@ int Sensors::activate(
         return RESULT_BAD_VALUE;
     }
 
-    /* Exit early if sensor is already enabled/disabled. */
-    uint32_t mask = (1U << handle);
-    uint32_t sensors = enabled ? mask : 0;
+    uint32_t const mask = (1U << handle);
 
     pthread_mutex_lock(&mSensorDevice->lock);
 
-    uint32_t active = mSensorDevice->active_sensors;
-    uint32_t new_sensors = (active & ~mask) | (sensors & mask);
-    uint32_t changed = active ^ new_sensors;
+    /* Exit early if sensor is already enabled/disabled. */
+    bool const active = mSensorDevice->active_sensors.load() & mask;
+    if (active == enabled) {
+        pthread_mutex_unlock(&mSensorDevice->lock);
+        return RESULT_OK;
+    }
+
+    /* A detector only reports what happens after it got activated, the
+     * others keep what they saw so far */
+    if (enabled && (mask & kMotionDetectors)) {
+        pthread_mutex_lock(&mSensorDevice->fusion_lock);
+        sensor_device_motion_detector(mSensorDevice, handle).reset();
+        pthread_mutex_unlock(&mSensorDevice->fusion_lock);
+    }
+
+    /* The event loops clear the bits of one-shot sensors that fired, only
+     * ever change the bit of |handle| */
+    if (enabled)
+        mSensorDevice->active_sensors.fetch_or(mask);
+    else
+        mSensorDevice->active_sensors.fetch_and(~mask);
 
-    if (changed) {
+    int const result = sensor_device_update_locked(mSensorDevice, handle);
+    if (result != RESULT_OK) {
         if (enabled)
-            mSensorDevice->mSensorFWDevice->EnableSensorEvents(handle);
+            mSensorDevice->active_sensors.fetch_and(~mask);
         else
-            mSensorDevice->mSensorFWDevice->DisableSensorEvents(handle);
-        mSensorDevice->active_sensors = new_sensors;
+            mSensorDevice->active_sensors.fetch_or(mask);
     }
     pthread_mutex_unlock(&mSensorDevice->lock);
-    return RESULT_OK;
+    return result;
 }
 
-std::vector<sensors_event_t> Sensors::poll(int32_t maxCount, int *err_out) {
-    std::vector<sensors_event_t> out;
-    int err = 0;
+int Sensors::batch(
+        int32_t handle, int64_t samplingPeriodNs, int64_t maxReportLatencyNs) {
 
-    if (maxCount <= 0) {
-        err = -EINVAL;
-    } else {
-        int bufferSize = maxCount <= kPollMaxBufferSize ? maxCount : kPollMaxBufferSize;
+    /* Sanity check */
+    if (!ID_CHECK(handle)) {
+        GERR("batch: bad handle ID: %d", handle);
+        return RESULT_BAD_VALUE;
+    }
+    if (samplingPeriodNs < 0) {
+        GERR("batch: bad sampling period: %" PRId64, samplingPeriodNs);
+        return RESULT_BAD_VALUE;
+    }
+    if (maxReportLatencyNs < 0) {
+        GERR("batch: bad max report latency: %" PRId64, maxReportLatencyNs);
+        return RESULT_BAD_VALUE;
+    }
+    if (!sensor_device_is_available(mSensorDevice, handle)) {
+        GERR("batch: sensor %d is not available", handle);
+        return RESULT_BAD_VALUE;
+    }
 
-        if (!mSensorDevice->pendingSensors) {
-            mSensorDevice->waiting_for_data = true;
-            g_main_loop_run(mSensorDevice->loop);
-            mSensorDevice->waiting_for_data = false;
-        }
-        out.resize(bufferSize);
+    /* Events are held in the FIFO of the sensor for up to this long */
+    mSensorDevice->max_report_latency[handle].store(maxReportLatencyNs,
+                                                    std::memory_order_relaxed);
 
-        /* Now read as many pending events as needed. */
-        for (int i = 0; i < bufferSize; i++)  {
-            if (!mSensorDevice->pendingSensors) {
-                break;
-            }
-            int ret = sensor_device_pick_pending_event_locked(mSensorDevice, &out[i]);
-            if (ret < 0) {
-                if (!err) {
-                    err = ret;
-                }
-                break;
-            }
-            err++;
-        }
-    }
+    /* On-change and one-shot sensors report at their own pace */
+    int32_t const minDelay = mSensorDevice->min_delay[handle];
+    int32_t const maxDelay = mSensorDevice->max_delay[handle];
+    if (minDelay <= 0)
+        return RESULT_OK;
+
+    int64_t periodUs = std::max<int64_t>(samplingPeriodNs / 1000, minDelay);
+    if (maxDelay > 0)
+        periodUs = std::min<int64_t>(periodUs, maxDelay);
+
+    pthread_mutex_lock(&mSensorDevice->lock);
+    mSensorDevice->batch_period_us[handle] = periodUs;
+    int const ret = sensor_device_update_locked(mSensorDevice, handle);
+    pthread_mutex_unlock(&mSensorDevice->lock);
+
+    return ret;
+}
+
+size_t Sensors::pollBufferSize(int32_t maxCount) {
+    if (maxCount <= 0)
+        return 0;
+
+    return maxCount <= kPollMaxBufferSize ? maxCount : kPollMaxBufferSize;
+}
+
+size_t Sensors::poll(int32_t maxCount, sensors_event_t *events, int *err_out) {
+    size_t const bufferSize = pollBufferSize(maxCount);
 
-out:
-    if (err < 0) {
+    if (bufferSize == 0) {
         *err_out = RESULT_BAD_VALUE;
-        return out;
+        return 0;
     }
 
-    const size_t count = (size_t)err;
-    out.resize(count);
-
     *err_out = RESULT_OK;
-    return out;
+    return sensor_device_poll(mSensorDevice, events, bufferSize);
 }
 
 int Sensors::flush(int32_t handle) {
@@ -675,28 +905,124 @@ int Sensors::flush(int32_t handle) {
         return RESULT_BAD_VALUE;
     }
 
+    /* One-shot sensors have nothing to flush */
+    if ((waydroid::kSensorTable[handle].flags & waydroid::kReportingModeMask) ==
+        SENSOR_FLAG_ONE_SHOT_MODE)
+        return RESULT_BAD_VALUE;
+
+    /* Completed by POLL once the events queued so far are delivered. The
+     * marks of one handle are queued in order, FLUSH runs on many threads. */
+    pthread_mutex_lock(&mSensorDevice->flush_lock);
+    bool const queued = mSensorDevice->flush_marks[handle].push(
+        mSensorDevice->events[handle].pushed());
+    pthread_mutex_unlock(&mSensorDevice->flush_lock);
+
+    if (!queued) {
+        GERR("flush: too many pending flushes for handle %d", handle);
+        return RESULT_NO_MEMORY;
+    }
+    sensor_device_wake(mSensorDevice);
+
+    return RESULT_OK;
+}
+
+int Sensors::registerDirectChannel(SharedMemType type, SharedMemFormat format,
+                                   int fd, uint32_t size, int32_t *channelHandle) {
+    *channelHandle = -1;
+
+    if (type != SharedMemType::ASHMEM || format != SharedMemFormat::SENSORS_EVENT) {
+        GERR("registerDirectChannel: unsupported memory type %u format %u",
+             (unsigned)type, (unsigned)format);
+        return RESULT_BAD_VALUE;
+    }
+
+    /* The fd of the request is closed along with it, keep our own */
+    int const own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (own_fd < 0) {
+        GERR("registerDirectChannel: can't duplicate fd %d: %s", fd, strerror(errno));
+        return errno == EBADF ? RESULT_BAD_VALUE : RESULT_NO_MEMORY;
+    }
+
+    auto channel = DirectChannel::create(own_fd, size);
+    if (!channel)
+        return RESULT_NO_MEMORY;
+
+    pthread_mutex_lock(&mSensorDevice->direct_lock);
+    *channelHandle = mSensorDevice->next_direct_channel++;
+    mSensorDevice->direct_channels[*channelHandle] = std::move(channel);
+    pthread_mutex_unlock(&mSensorDevice->direct_lock);
+
+    GINFO("Registered direct channel %d of %u bytes", *channelHandle, size);
+    return RESULT_OK;
+}
+
+int Sensors::unregisterDirectChannel(int32_t channelHandle) {
+    pthread_mutex_lock(&mSensorDevice->lock);
+
+    pthread_mutex_lock(&mSensorDevice->direct_lock);
+    bool const found = mSensorDevice->direct_channels.erase(channelHandle) > 0;
+    pthread_mutex_unlock(&mSensorDevice->direct_lock);
+
+    if (found)
+        sensor_device_update_direct_locked(mSensorDevice);
+
+    pthread_mutex_unlock(&mSensorDevice->lock);
+    return found ? RESULT_OK : RESULT_BAD_VALUE;
+}
+
+int Sensors::configDirectReport(int32_t sensorHandle, int32_t channelHandle,
+                                RateLevel rate, int32_t *reportToken) {
+    *reportToken = 0;
+
+    /* Handle -1 can only stop all sensors of the channel */
+    if (sensorHandle == -1 ? rate != RateLevel::STOP :
+        !ID_CHECK(sensorHandle) ||
+        !sensor_device_is_available(mSensorDevice, sensorHandle) ||
+        mSensorDevice->min_delay[sensorHandle] <= 0) {
+        GERR("configDirectReport: bad handle ID: %d", sensorHandle);
+        return RESULT_BAD_VALUE;
+    }
+
+    /* Only up to the rate level advertised in the sensor list */
+    if (sensorHandle != -1 &&
+        (rate < RateLevel::STOP ||
+         rate > direct_report_max_rate(mSensorDevice->min_delay[sensorHandle]))) {
+        GERR("configDirectReport: bad rate level %d for handle %d",
+             (int)rate, sensorHandle);
+        return RESULT_BAD_VALUE;
+    }
+
     pthread_mutex_lock(&mSensorDevice->lock);
-    if ((mSensorDevice->pendingSensors & (1U << handle)) &&
-        mSensorDevice->sensors[handle].sensorType == SENSOR_TYPE_META_DATA)
-    {
-        // A 'flush' operation is already pending. Just increment the count.
-        (mSensorDevice->flush_count[handle])++;
+    pthread_mutex_lock(&mSensorDevice->direct_lock);
+
+    int result = RESULT_OK;
+    auto const it = mSensorDevice->direct_channels.find(channelHandle);
+    if (it == mSensorDevice->direct_channels.end()) {
+        result = RESULT_BAD_VALUE;
+    } else if (sensorHandle == -1) {
+        for (int i = 0; i < MAX_NUM_SENSORS; i++)
+            it->second->configure(i, RateLevel::STOP);
     } else {
-        mSensorDevice->flush_count[handle] = 0;
-        mSensorDevice->sensors[handle].sensorType = SENSOR_TYPE_META_DATA;
-        mSensorDevice->sensors[handle].timestamp = 0;
-        mSensorDevice->sensors[handle].sensorHandle = handle;
-        mSensorDevice->sensors[handle].u.meta.what = META_DATA_FLUSH_COMPLETE;
-        mSensorDevice->pendingSensors |= (1U << handle);
+        int32_t const token = it->second->configure(sensorHandle, rate);
+        if (rate != RateLevel::STOP)
+            *reportToken = token;
     }
+    pthread_mutex_unlock(&mSensorDevice->direct_lock);
+
+    if (result == RESULT_OK)
+        sensor_device_update_direct_locked(mSensorDevice);
+
     pthread_mutex_unlock(&mSensorDevice->lock);
-    
-    return RESULT_OK;
+    return result;
 }
 
 void Sensors::killLoops() {
-    if (mSensorDevice->waiting_for_data)
-        g_main_loop_quit(mSensorDevice->loop);
+    mSensorDevice->killed.store(true, std::memory_order_release);
+    eventfd_write(mSensorDevice->wake_fd, 1);
+}
+
+void Sensors::resumeLoops() {
+    mSensorDevice->killed.store(false, std::memory_order_release);
 }
 
 }  // namespace implementation
@@ -23,7 +23,18 @@
 #include <gutil_log.h>
 #include <glib-unix.h>
 
+#include <atomic>
+#include <map>
+#include <memory>
+
+#include <utils/clock_sync.h>
+#include <utils/spsc_ring.h>
+
 #include "hybrisbindertypes.h"
+#include "Calibration.h"
+#include "DirectChannel.h"
+#include "Fusion.h"
+#include "Motion.h"
 #include "SensorFW.h"
 
 using waydroid::SensorFW;
@@ -34,32 +45,119 @@ namespace implementation {
 
 constexpr char kWaydroidVendor[] = "The Waydroid Project";
 
+/* Events buffered per sensor handle between two POLLs, advertised as FIFO */
+constexpr size_t kEventRingSize = 256;
+/* Fill level at which a FIFO is delivered before its report latency is up */
+constexpr size_t kEventRingHighWatermark = kEventRingSize * 3 / 4;
+
+typedef waydroid::core::SpscRing<sensors_event_t, kEventRingSize> EventRing;
+
+/* FLUSH requests that may be outstanding per sensor handle */
+constexpr size_t kMaxPendingFlushes = 64;
+
+/* EventRing::pushed() positions pending flushes complete at */
+typedef waydroid::core::SpscRing<size_t, kMaxPendingFlushes> FlushRing;
+
 typedef struct SensorDevice {
     SensorFW *mSensorFWDevice;
     uint64_t last_TimeStamp[MAX_NUM_SENSORS];
-    sensors_event_t sensors[MAX_NUM_SENSORS];
-    uint32_t pendingSensors;
-    int64_t timeStart;
-    int64_t timeOffset;
-    uint32_t active_sensors;
-    int flush_count[MAX_NUM_SENSORS];
+    /* Filled by the sensorfw event loops, drained by POLL */
+    EventRing events[MAX_NUM_SENSORS];
+    /* Maps the sensord clock of each sensorfw channel to CLOCK_BOOTTIME */
+    waydroid::core::ClockSync clock_sync[MAX_NUM_SENSORS];
+    /* Timestamp of the last event queued per sensor handle */
+    int64_t last_event_time[MAX_NUM_SENSORS];
+    /* Sensors activated for POLL */
+    std::atomic<uint32_t> active_sensors;
+    /* Sampling period limits from the sensor list, in microseconds */
+    int32_t min_delay[MAX_NUM_SENSORS];
+    int32_t max_delay[MAX_NUM_SENSORS];
+    /* Sampling periods asked for by BATCH and by direct channels */
+    int64_t batch_period_us[MAX_NUM_SENSORS];
+    int64_t direct_period_us[MAX_NUM_SENSORS];
+    /* Pending flushes, queued by FLUSH under flush_lock and completed by
+     * POLL once the events queued before them are read */
+    FlushRing flush_marks[MAX_NUM_SENSORS];
+    pthread_mutex_t flush_lock;
+    /* maxReportLatency from BATCH, in nanoseconds */
+    std::atomic<int64_t> max_report_latency[MAX_NUM_SENSORS];
+    /* Arrival time of the oldest undelivered event of each FIFO */
+    std::atomic<int64_t> batch_since[MAX_NUM_SENSORS];
     pthread_mutex_t lock;
-    GMainLoop* loop;
-    bool waiting_for_data;
+    /* Direct report channels by channel handle, guarded by direct_lock */
+    std::map<int32_t, std::unique_ptr<DirectChannel>> direct_channels;
+    int32_t next_direct_channel;
+    /* Sensors reported through any direct channel */
+    std::atomic<uint32_t> direct_sensors;
+    pthread_mutex_t direct_lock;
+    /* eventfd a POLL waiting for data sleeps on */
+    int wake_fd;
+    std::atomic<bool> waiting_for_data;
+    /* An event landed in an empty FIFO, so a waiting POLL has a new
+     * deadline to sleep until */
+    std::atomic<bool> deadline_changed;
+    std::atomic<bool> killed;
+    /* Calibrations and virtual sensors, fed by the sensorfw event loops
+     * under fusion_lock */
+    GyroBiasEstimator gyro_bias;
+    MagneticCalibration magnetic_calibration;
+    GravityFusion gravity;
+    OrientationFusion game_orientation{false};
+    OrientationFusion orientation{true};
+    OrientationFusion geomagnetic_orientation{true};
+    /* One per detector, each only knows what happened since it got
+     * activated */
+    MotionDetector significant_motion;
+    MotionDetector stationary_detect;
+    MotionDetector motion_detect;
+    /* Rate the virtual sensors are reported at, in nanoseconds, and the
+     * sensor time of their last event */
+    std::atomic<int64_t> fused_period_ns[MAX_NUM_SENSORS];
+    int64_t last_fused_time[MAX_NUM_SENSORS];
+    pthread_mutex_t fusion_lock;
+    /* One-shot sensors that fired and turned themselves off since, their
+     * sources are updated by the next POLL */
+    std::atomic<uint32_t> fired_sensors;
 } SensorDevice;
 
+/* The event path from the sensorfw channels to POLL, see Sensors.cpp */
+void sensor_event_cb(void *userdata, int id, uint64_t ts,
+                     sensors_event_t const *events, size_t count);
+void sensor_wake_cb(void *userdata);
+int sensor_device_pick_pending_event_locked(SensorDevice *d,
+                                            sensors_event_t* event);
+size_t sensor_device_poll(SensorDevice *d, sensors_event_t *events,
+                          size_t bufferSize);
+
 struct Sensors {
     Sensors();
 
-    std::vector<sensor_t> getSensorsList();
+    /* Built once, sensor availability is settled when Sensors is created */
+    std::vector<sensor_t> const& getSensorsList() const;
     int activate(int32_t handle, bool enabled);
-    std::vector<sensors_event_t> poll(int32_t maxCount, int *err_out);
+    int batch(int32_t handle, int64_t samplingPeriodNs, int64_t maxReportLatencyNs);
+    /* Blocks until events are due and moves up to |maxCount| of them into
+     * |events|, which has room for pollBufferSize(maxCount). Returns the
+     * number of events written. */
+    size_t poll(int32_t maxCount, sensors_event_t *events, int *err_out);
+    static size_t pollBufferSize(int32_t maxCount);
     int flush(int32_t handle);
+    int registerDirectChannel(SharedMemType type, SharedMemFormat format,
+                              int fd, uint32_t size, int32_t *channelHandle);
+    int unregisterDirectChannel(int32_t channelHandle);
+    int configDirectReport(int32_t sensorHandle, int32_t channelHandle,
+                           RateLevel rate, int32_t *reportToken);
+    /* Ends the POLL in progress, or the next one if none is */
     void killLoops();
+    /* Drops a kill no POLL consumed, for a service that registers again */
+    void resumeLoops();
 
 private:
+    std::vector<sensor_t> buildSensorsList();
+
     static constexpr int32_t kPollMaxBufferSize = 128;
     SensorDevice *mSensorDevice;
+    std::vector<sensor_t> mSensorsList;
 };
 
 }  // namespace implementation
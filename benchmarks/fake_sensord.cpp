@@ -0,0 +1,463 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fake_sensord.h"
+
+#include <gutil_log.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <stdexcept>
+
+namespace waydroid {
+namespace benchmarks {
+
+namespace {
+
+char const* const kServiceName = "com.nokia.SensorService";
+char const* const kManagerPath = "/SensorManager";
+char const* const kManagerInterface = "local.SensorManager";
+
+char const* const kManagerXml =
+    "<node>"
+    "  <interface name='local.SensorManager'>"
+    "    <method name='loadPlugin'>"
+    "      <arg type='s' direction='in'/>"
+    "      <arg type='b' direction='out'/>"
+    "    </method>"
+    "    <method name='requestSensor'>"
+    "      <arg type='s' direction='in'/>"
+    "      <arg type='x' direction='in'/>"
+    "      <arg type='i' direction='out'/>"
+    "    </method>"
+    "    <method name='releaseSensor'>"
+    "      <arg type='s' direction='in'/>"
+    "      <arg type='i' direction='in'/>"
+    "      <arg type='x' direction='in'/>"
+    "      <arg type='b' direction='out'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+/* printf format taking the interface name of a plugin */
+char const* const kPluginXml =
+    "<node>"
+    "  <interface name='%s'>"
+    "    <method name='start'>"
+    "      <arg type='i' direction='in'/>"
+    "    </method>"
+    "    <method name='stop'>"
+    "      <arg type='i' direction='in'/>"
+    "    </method>"
+    "    <method name='setInterval'>"
+    "      <arg type='i' direction='in'/>"
+    "      <arg type='i' direction='in'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+/* What sensord writes after reading the session id of a data connection */
+char const kSocketTag = '\n';
+
+uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+}  // namespace
+
+struct FakeSensord::Session {
+    int id;
+    FakePlugin const* plugin;
+    Counters* counters;
+
+    /* Guards the fields below, |wake| interrupts the streamer */
+    std::mutex lock;
+    std::condition_variable wake;
+    int fd;
+    bool started;
+    int intervalMs;
+    bool released;
+
+    std::thread streamer;
+};
+
+FakeSensord::FakeSensord(std::vector<FakePlugin> const& plugins,
+                         unsigned batchSize, int defaultIntervalMs)
+    : mPlugins(plugins),
+      mBatchSize(std::max(1u, std::min(batchSize, 1000u))),
+      mDefaultIntervalMs(std::max(1, defaultIntervalMs)),
+      mBus(g_test_dbus_new(G_TEST_DBUS_NONE)),
+      mDir(NULL),
+      mListenFd(-1),
+      mLoop("fake-sensord"),
+      mNextSession(1) {
+    for (auto const& plugin : mPlugins)
+        mCounters[plugin.name].reset(new Counters());
+
+    g_test_dbus_up(mBus);
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address(mBus), 1);
+
+    GError* error = NULL;
+    mDir = g_dir_make_tmp("waydroid-sensors-XXXXXX", &error);
+    if (!mDir) {
+        GERR("Failed to create the socket directory: %s", error->message);
+        g_error_free(error);
+        return;
+    }
+    mSocketPath = std::string(mDir) + "/sensord.sock";
+    setenv("SENSORFW_SOCKET_PATH", mSocketPath.c_str(), 1);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, mSocketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        GERR("Failed to listen on %s: %s", mSocketPath.c_str(), strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    mListenFd = fd;
+
+    mLoop.enqueue([this] {
+        try {
+            mConnection.reset(new core::DBusConnectionHandle(
+                g_test_dbus_get_bus_address(mBus)));
+            exportObjects();
+            mConnection->request_name(kServiceName);
+        } catch (std::exception const& e) {
+            GERR("%s", e.what());
+            mConnection.reset();
+        }
+    }).wait();
+
+    mLoop.watch_fd(mListenFd, [this] { acceptConnection(); });
+}
+
+FakeSensord::~FakeSensord() {
+    mLoop.enqueue([this] {
+        if (mConnection) {
+            for (auto id : mRegistrations)
+                g_dbus_connection_unregister_object(*mConnection, id);
+            mConnection.reset();
+        }
+    }).wait();
+    mLoop.stop();
+
+    std::map<int, std::shared_ptr<Session>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        sessions.swap(mSessions);
+    }
+    for (auto const& session : sessions)
+        stopSession(session.second);
+
+    if (mListenFd >= 0)
+        close(mListenFd);
+    if (mDir) {
+        unlink(mSocketPath.c_str());
+        g_rmdir(mDir);
+        g_free(mDir);
+    }
+
+    g_test_dbus_down(mBus);
+    g_object_unref(mBus);
+}
+
+uint64_t FakeSensord::sent(const char* plugin) const {
+    auto it = mCounters.find(plugin);
+    return it != mCounters.end() ? it->second->sent.load() : 0;
+}
+
+uint64_t FakeSensord::dropped(const char* plugin) const {
+    auto it = mCounters.find(plugin);
+    return it != mCounters.end() ? it->second->dropped.load() : 0;
+}
+
+/* Runs on mLoop, which also dispatches the method calls from then on */
+void FakeSensord::exportObjects() {
+    static const GDBusInterfaceVTable vtable = { &FakeSensord::methodCall, NULL, NULL, { 0 } };
+
+    auto exportObject = [this](std::string const& path, const gchar* xml) {
+        GError* error = NULL;
+        GDBusNodeInfo* node = g_dbus_node_info_new_for_xml(xml, &error);
+        guint id = 0;
+
+        if (node) {
+            id = g_dbus_connection_register_object(*mConnection, path.c_str(),
+                node->interfaces[0], &vtable, this, NULL, &error);
+            g_dbus_node_info_unref(node);
+        }
+        if (!id) {
+            std::string message = "Failed to export " + path + ": " + error->message;
+            g_error_free(error);
+            throw std::runtime_error(message);
+        }
+        mRegistrations.push_back(id);
+    };
+
+    exportObject(kManagerPath, kManagerXml);
+
+    for (auto const& plugin : mPlugins) {
+        gchar* xml = g_strdup_printf(kPluginXml, plugin.interface);
+        try {
+            exportObject(std::string(kManagerPath) + "/" + plugin.name, xml);
+        } catch (...) {
+            g_free(xml);
+            throw;
+        }
+        g_free(xml);
+    }
+}
+
+void FakeSensord::methodCall(GDBusConnection* connection, const gchar* sender,
+                             const gchar* path, const gchar* interface,
+                             const gchar* method, GVariant* args,
+                             GDBusMethodInvocation* invocation, gpointer user_data) {
+    auto const self = static_cast<FakeSensord*>(user_data);
+    GVariant* reply = NULL;
+
+    /* Argument types were checked against the introspection data */
+    if (g_strcmp0(interface, kManagerInterface) != 0)
+        reply = self->sessionCall(method, args);
+    else if (g_strcmp0(method, "loadPlugin") == 0)
+        reply = self->loadPlugin(args);
+    else if (g_strcmp0(method, "requestSensor") == 0)
+        reply = self->requestSensor(args);
+    else if (g_strcmp0(method, "releaseSensor") == 0)
+        reply = self->releaseSensor(args);
+
+    g_dbus_method_invocation_return_value(invocation, reply);
+}
+
+GVariant* FakeSensord::loadPlugin(GVariant* args) {
+    const gchar* name = NULL;
+    g_variant_get(args, "(&s)", &name);
+
+    return g_variant_new("(b)", findPlugin(name) != nullptr);
+}
+
+GVariant* FakeSensord::requestSensor(GVariant* args) {
+    const gchar* name = NULL;
+    gint64 pid = 0;
+    g_variant_get(args, "(&sx)", &name, &pid);
+
+    FakePlugin const* plugin = findPlugin(name);
+    if (!plugin)
+        return g_variant_new("(i)", -1);
+
+    auto session = std::make_shared<Session>();
+    session->plugin = plugin;
+    session->counters = mCounters[plugin->name].get();
+    session->fd = -1;
+    session->started = false;
+    session->intervalMs = 0;
+    session->released = false;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        session->id = mNextSession++;
+        mSessions[session->id] = session;
+    }
+    session->streamer = std::thread(&FakeSensord::stream, this, session.get());
+
+    return g_variant_new("(i)", session->id);
+}
+
+GVariant* FakeSensord::releaseSensor(GVariant* args) {
+    const gchar* name = NULL;
+    gint32 id = -1;
+    gint64 pid = 0;
+    g_variant_get(args, "(&six)", &name, &id, &pid);
+
+    std::shared_ptr<Session> session;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mSessions.find(id);
+        if (it != mSessions.end()) {
+            session = it->second;
+            mSessions.erase(it);
+        }
+    }
+    if (session)
+        stopSession(session);
+
+    return g_variant_new("(b)", session != nullptr);
+}
+
+/* start, stop and setInterval of the plugin objects */
+GVariant* FakeSensord::sessionCall(const gchar* method, GVariant* args) {
+    gint32 id = -1;
+    g_variant_get_child(args, 0, "i", &id);
+
+    auto session = findSession(id);
+    if (!session)
+        return NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(session->lock);
+        if (g_strcmp0(method, "start") == 0) {
+            session->started = true;
+        } else if (g_strcmp0(method, "stop") == 0) {
+            session->started = false;
+        } else if (g_strcmp0(method, "setInterval") == 0) {
+            g_variant_get_child(args, 1, "i", &session->intervalMs);
+        }
+    }
+    session->wake.notify_all();
+
+    return NULL;
+}
+
+/* Runs on mLoop whenever a client connects to the data socket */
+void FakeSensord::acceptConnection() {
+    int fd = accept4(mListenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    /* The client writes its session id right after connecting */
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int id = -1;
+    std::shared_ptr<Session> session;
+    if (recv(fd, &id, sizeof(id), MSG_WAITALL) == sizeof(id))
+        session = findSession(id);
+
+    bool attached = false;
+    if (session && send(fd, &kSocketTag, 1, MSG_NOSIGNAL) == 1) {
+        std::lock_guard<std::mutex> lock(session->lock);
+        if (session->fd < 0 && !session->released) {
+            session->fd = fd;
+            attached = true;
+        }
+    }
+
+    if (!attached) {
+        GWARN("Rejected data connection for session %d", id);
+        close(fd);
+    }
+}
+
+/*
+ * Writes a frame of mBatchSize samples every mBatchSize intervals. Samples
+ * are zeroed apart from the timestamp, spaced by the interval and ending
+ * with the time the frame is written.
+ */
+void FakeSensord::stream(Session* session) {
+    size_t const sampleSize = session->plugin->sampleSize;
+    std::vector<char> frame(sizeof(uint32_t) + mBatchSize * sampleSize, 0);
+    uint32_t const count = mBatchSize;
+    memcpy(frame.data(), &count, sizeof(count));
+
+    auto next = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(session->lock);
+
+    while (!session->released) {
+        int const intervalMs = session->intervalMs > 0 ?
+            session->intervalMs : mDefaultIntervalMs;
+        uint64_t const intervalUs = uint64_t(intervalMs) * 1000;
+
+        /* After a stall, carry on from now instead of bursting */
+        next = std::max(next + std::chrono::microseconds(intervalUs * mBatchSize),
+                        std::chrono::steady_clock::now());
+        if (session->wake.wait_until(lock, next, [session] { return session->released; }))
+            break;
+
+        int const fd = session->fd;
+        if (!session->started || fd < 0)
+            continue;
+        lock.unlock();
+
+        uint64_t const now = monotonic_us();
+        for (unsigned i = 0; i < mBatchSize; i++) {
+            /* TimedData::timestamp_ leads every sample type */
+            uint64_t const timestamp = now - (mBatchSize - 1 - i) * intervalUs;
+            memcpy(&frame[sizeof(uint32_t) + i * sampleSize], &timestamp, sizeof(timestamp));
+        }
+
+        bool lost = false;
+        ssize_t written = send(fd, frame.data(), frame.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* The client fell behind, sensord drops the frame */
+            session->counters->dropped.fetch_add(mBatchSize);
+        } else {
+            /* A frame is never cut short, the rest of it may block */
+            size_t done = written > 0 ? written : 0;
+            while (written >= 0 && done < frame.size()) {
+                written = send(fd, frame.data() + done, frame.size() - done, MSG_NOSIGNAL);
+                if (written > 0)
+                    done += written;
+                else if (written < 0 && errno == EINTR)
+                    written = 0;
+            }
+            if (written < 0)
+                lost = true;
+            else
+                session->counters->sent.fetch_add(mBatchSize);
+        }
+
+        lock.lock();
+        if (lost && session->fd == fd) {
+            /* The client went away, it reconnects on the next session */
+            session->fd = -1;
+            close(fd);
+        }
+    }
+}
+
+void FakeSensord::stopSession(std::shared_ptr<Session> const& session) {
+    {
+        std::lock_guard<std::mutex> lock(session->lock);
+        session->released = true;
+    }
+    session->wake.notify_all();
+
+    if (session->streamer.joinable())
+        session->streamer.join();
+    if (session->fd >= 0)
+        close(session->fd);
+}
+
+FakePlugin const* FakeSensord::findPlugin(const char* name) const {
+    for (auto const& plugin : mPlugins) {
+        if (g_strcmp0(plugin.name, name) == 0)
+            return &plugin;
+    }
+    return nullptr;
+}
+
+std::shared_ptr<FakeSensord::Session> FakeSensord::findSession(int id) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mSessions.find(id);
+    return it != mSessions.end() ? it->second : nullptr;
+}
+
+}  // namespace benchmarks
+}  // namespace waydroid
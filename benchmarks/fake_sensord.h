@@ -0,0 +1,134 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WAYDROID_BENCHMARKS_FAKE_SENSORD_H_
+#define WAYDROID_BENCHMARKS_FAKE_SENSORD_H_
+
+#include <gio/gio.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <plugins/sensorfw_channel.h>
+#include <utils/dbus_connection_handle.h>
+#include <utils/event_loop.h>
+
+namespace waydroid {
+namespace benchmarks {
+
+/* A sensorfw plugin the stand-in sensord serves */
+struct FakePlugin {
+    const char* name;
+    const char* interface;
+    /* Size of one sample on the data socket, a TimedData subclass */
+    size_t sampleSize;
+};
+
+template<typename T, core::Sensorfw::PluginType P>
+FakePlugin fake_plugin_of(core::SensorfwChannel<T, P> const*) {
+    static_assert(std::is_base_of<TimedData, T>::value, "samples are stamped as TimedData");
+    return FakePlugin{ core::SensorfwPlugin<P>::string(),
+                       core::SensorfwPlugin<P>::interface(), sizeof(T) };
+}
+
+/* The plugin serving |Channel|, e.g. core::SensorfwAccelerometerSensor */
+template<typename Channel>
+FakePlugin fake_plugin() {
+    return fake_plugin_of(static_cast<Channel const*>(nullptr));
+}
+
+/*
+ * Stand-in for sensorfw: a private dbus-daemon with com.nokia.SensorService
+ * on it and a sensord data socket in a temporary directory. The constructor
+ * points DBUS_SYSTEM_BUS_ADDRESS and SENSORFW_SOCKET_PATH of this process
+ * at them, so a SensorFW created afterwards talks to the stand-in.
+ *
+ * Started sessions stream zeroed samples stamped with CLOCK_MONOTONIC, at
+ * the interval the client set or |defaultIntervalMs|, |batchSize| samples
+ * per socket frame. A frame that doesn't fit into the socket is dropped,
+ * like sensord does with a stalled client.
+ */
+class FakeSensord {
+public:
+    FakeSensord(std::vector<FakePlugin> const& plugins,
+                unsigned batchSize, int defaultIntervalMs);
+    ~FakeSensord();
+
+    /* Whether the bus and the data socket are up */
+    bool ok() const { return mConnection != nullptr && mListenFd >= 0; }
+
+    /* Samples of |plugin| written to, or dropped at, the data sockets */
+    uint64_t sent(const char* plugin) const;
+    uint64_t dropped(const char* plugin) const;
+
+private:
+    struct Session;
+    struct Counters {
+        std::atomic<uint64_t> sent;
+        std::atomic<uint64_t> dropped;
+    };
+
+    FakeSensord(FakeSensord const&) = delete;
+    FakeSensord& operator=(FakeSensord const&) = delete;
+
+    void exportObjects();
+    void acceptConnection();
+    void stream(Session* session);
+    void stopSession(std::shared_ptr<Session> const& session);
+
+    FakePlugin const* findPlugin(const char* name) const;
+    std::shared_ptr<Session> findSession(int id);
+
+    GVariant* loadPlugin(GVariant* args);
+    GVariant* requestSensor(GVariant* args);
+    GVariant* releaseSensor(GVariant* args);
+    GVariant* sessionCall(const gchar* method, GVariant* args);
+
+    static void methodCall(GDBusConnection* connection, const gchar* sender,
+                           const gchar* path, const gchar* interface,
+                           const gchar* method, GVariant* args,
+                           GDBusMethodInvocation* invocation, gpointer user_data);
+
+    std::vector<FakePlugin> mPlugins;
+    unsigned mBatchSize;
+    int mDefaultIntervalMs;
+
+    GTestDBus* mBus;
+    gchar* mDir;
+    std::string mSocketPath;
+    int mListenFd;
+
+    /* Serves the bus and accepts data connections */
+    core::EventLoop mLoop;
+    std::unique_ptr<core::DBusConnectionHandle> mConnection;
+    std::vector<guint> mRegistrations;
+
+    std::mutex mLock;
+    int mNextSession;
+    std::map<int, std::shared_ptr<Session>> mSessions;
+    std::map<std::string, std::unique_ptr<Counters>> mCounters;
+};
+
+}  // namespace benchmarks
+}  // namespace waydroid
+
+#endif  // WAYDROID_BENCHMARKS_FAKE_SENSORD_H_
@@ -0,0 +1,538 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the HAL hot path: sample conversion, queueing events
+ * for POLL, the virtual sensors, picking events up again, parsing sensord
+ * socket frames and serializing the POLL reply.
+ *
+ * Prints one JSON object per benchmark and line, with the median and
+ * minimum nanoseconds per item over several rounds, so results of two
+ * releases can be compared by name.
+ */
+
+#include "PollReply.h"
+#include "Sensors.h"
+#include "SensorTable.h"
+
+#include <utils/socketreader.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace waydroid::sensors::implementation;
+using waydroid::SensorTraits;
+using waydroid::kSensorTable;
+using waydroid::kMaxEventsPerSample;
+
+namespace {
+
+/* A round is repeated with more iterations until it takes this long */
+constexpr int64_t kMinRoundNs = 20000000;
+/* Samples converted or queued per iteration, fits into an event ring */
+constexpr size_t kSamples = 128;
+/* Events queued per sensor before picking them up */
+constexpr size_t kPendingPerSensor = 64;
+/* Socket frames written and then parsed per iteration */
+constexpr size_t kFrames = 32;
+/* IMU rate the virtual sensors are fed at, in microseconds */
+constexpr uint64_t kImuPeriodUs = 5000;
+
+gchar* opt_filter = NULL;
+gint opt_rounds = 7;
+gchar* opt_device = NULL;
+
+const GOptionEntry kOptions[] = {
+    { "filter", 'f', 0, G_OPTION_ARG_STRING, &opt_filter,
+      "Only run benchmarks whose name contains TEXT", "TEXT" },
+    { "rounds", 'r', 0, G_OPTION_ARG_INT, &opt_rounds,
+      "Timed rounds per benchmark [7]", "N" },
+    { "device", 'd', 0, G_OPTION_ARG_STRING, &opt_device,
+      "Binder device for the POLL reply benchmarks [/dev/anbox-hwbinder]", "DEV" },
+    { NULL }
+};
+
+struct Benchmark {
+    std::string name;
+    /* What one item is, results are in nanoseconds per item */
+    const char* per;
+    size_t items;
+    /* Runs |iterations| iterations of |items| items, returns the
+     * nanoseconds spent in the measured part */
+    std::function<int64_t(uint64_t iterations)> run;
+    /* Why the benchmark can't run here, NULL if it can */
+    const char* skipped;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+int64_t elapsed_ns(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+/* Keeps the compiler from optimizing away what produced |value| */
+template<typename T>
+inline void keep(T const& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/* Zeroed samples stamped 1 ms apart, laid out like a socket frame */
+template<typename T>
+std::shared_ptr<T> make_samples(size_t count) {
+    void* raw = ::operator new(sizeof(T) * count);
+    memset(raw, 0, sizeof(T) * count);
+
+    T* samples = static_cast<T*>(raw);
+    for (size_t i = 0; i < count; i++)
+        samples[i].timestamp_ = (i + 1) * 1000;
+
+    return std::shared_ptr<T>(samples, [](T* p) { ::operator delete(p); });
+}
+
+uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* SensorTraits<Id>::convert() alone */
+template<int Id>
+Benchmark convert_benchmark() {
+    typedef SensorTraits<Id> Traits;
+
+    auto samples = make_samples<typename Traits::Sample>(kSamples);
+    sensors_event_t events[kMaxEventsPerSample];
+    size_t const perSample = Traits::convert(samples.get()[0], events);
+
+    return { std::string("convert/") + kSensorTable[Id].tag, "event",
+        kSamples * perSample,
+        [samples](uint64_t iterations) {
+            sensors_event_t events[kMaxEventsPerSample];
+            auto const start = Clock::now();
+
+            for (uint64_t n = 0; n < iterations; n++) {
+                for (size_t i = 0; i < kSamples; i++) {
+                    Traits::convert(samples.get()[i], events);
+                    keep(events);
+                }
+            }
+            return elapsed_ns(start);
+        }, NULL };
+}
+
+/* A sample from the socket to the event ring: convert() and
+ * sensor_event_cb(), as the channel sinks do it */
+template<int Id>
+Benchmark event_cb_benchmark(SensorDevice* dev) {
+    typedef SensorTraits<Id> Traits;
+
+    auto samples = make_samples<typename Traits::Sample>(kSamples);
+    sensors_event_t events[kMaxEventsPerSample];
+    size_t const perSample = Traits::convert(samples.get()[0], events);
+    /* sensorfw timestamps must advance, or samples are deduplicated */
+    auto clock = std::make_shared<uint64_t>(monotonic_us());
+
+    return { std::string("event_cb/") + kSensorTable[Id].tag, "event",
+        kSamples * perSample,
+        [dev, samples, clock](uint64_t iterations) {
+            sensors_event_t events[kMaxEventsPerSample];
+            sensors_event_t drained;
+            int64_t spent = 0;
+
+            for (uint64_t n = 0; n < iterations; n++) {
+                auto const start = Clock::now();
+                for (size_t i = 0; i < kSamples; i++) {
+                    size_t const count = Traits::convert(samples.get()[i], events);
+                    sensor_event_cb(dev, Id, ++*clock, events, count);
+                }
+                spent += elapsed_ns(start);
+
+                while (sensor_device_pick_pending_event_locked(dev, &drained) >= 0)
+                    ;
+            }
+            return spent;
+        }, NULL };
+}
+
+/* The virtual sensors in |mask| fed by a turning device at 200 Hz, as
+ * the channel sinks do it. An item is one step of the IMU: a gyroscope
+ * and an accelerometer event, and every other step a magnetometer one.
+ * At 200 Hz a step taking N ns costs N / 50000 percent of a core. */
+Benchmark fusion_benchmark(SensorDevice* dev, const char* name, uint32_t mask) {
+    struct Step {
+        sensors_event_t gyro;
+        sensors_event_t accel;
+        /* Calibrated and uncalibrated, as converted */
+        sensors_event_t mag[2];
+    };
+    auto steps = std::make_shared<std::vector<Step>>(kSamples);
+    Vector3 const rate = { 0.3f, -0.2f, 0.8f };
+    Quaternion device = { 1.0f, 0.0f, 0.0f, 0.0f };
+
+    for (auto& step : *steps) {
+        device = normalized(device * rotation_of(rate * (kImuPeriodUs * 1e-6f)));
+        Quaternion const inverse = { device.w, -device.x, -device.y, -device.z };
+        Vector3 const a = rotate(inverse, { 0.0f, 0.0f, 9.81f });
+        Vector3 const m = rotate(inverse, { 0.0f, 20.0f, -40.0f });
+
+        waydroid::sensor_event_init(step.gyro, ID_GYROSCOPE).u.vec3 =
+            { rate.x, rate.y, rate.z, ACCURACY_MEDIUM };
+        waydroid::sensor_event_init(step.accel, ID_ACCELEROMETER).u.vec3 =
+            { a.x, a.y, a.z, ACCURACY_MEDIUM };
+        waydroid::sensor_event_init(step.mag[0], ID_MAGNETIC_FIELD).u.vec3 =
+            { m.x, m.y, m.z, ACCURACY_MEDIUM };
+        waydroid::sensor_event_init(step.mag[1], ID_MAGNETIC_FIELD_UNCALIBRATED).u.uncal =
+            { m.x, m.y, m.z, 0.0f, 0.0f, 0.0f };
+    }
+    auto clock = std::make_shared<uint64_t>(monotonic_us());
+
+    return { std::string("fusion/") + name, "step", kSamples,
+        [dev, mask, steps, clock](uint64_t iterations) {
+            uint32_t const active = dev->active_sensors.exchange(mask);
+            sensors_event_t drained;
+            int64_t spent = 0;
+
+            for (uint64_t n = 0; n < iterations; n++) {
+                auto const start = Clock::now();
+                for (size_t i = 0; i < kSamples; i++) {
+                    Step const& step = (*steps)[i];
+                    uint64_t const ts = *clock += kImuPeriodUs;
+                    sensor_event_cb(dev, ID_GYROSCOPE, ts, &step.gyro, 1);
+                    sensor_event_cb(dev, ID_ACCELEROMETER, ts, &step.accel, 1);
+                    if (i % 2 == 0)
+                        sensor_event_cb(dev, ID_MAGNETIC_FIELD, ts, step.mag, 2);
+                }
+                spent += elapsed_ns(start);
+
+                while (sensor_device_pick_pending_event_locked(dev, &drained) >= 0)
+                    ;
+            }
+
+            dev->active_sensors = active;
+            return spent;
+        }, NULL };
+}
+
+/* Picking up events pending for the sensors in |mask|, merged by time */
+Benchmark pick_benchmark(SensorDevice* dev, const char* name, uint32_t mask) {
+    size_t sensors = 0;
+    for (int i = 0; i < MAX_NUM_SENSORS; i++)
+        sensors += (mask >> i) & 1;
+
+    /* With nothing pending, each item is a call finding nothing */
+    size_t const items = sensors ? sensors * kPendingPerSensor : kPendingPerSensor;
+
+    return { std::string("pick_pending/") + name, sensors ? "event" : "call", items,
+        [dev, mask](uint64_t iterations) {
+            sensors_event_t event;
+            int64_t spent = 0;
+
+            for (uint64_t n = 0; n < iterations; n++) {
+                for (size_t j = 0; j < kPendingPerSensor; j++) {
+                    for (int i = 0; i < MAX_NUM_SENSORS; i++) {
+                        if (!(mask & (1U << i)))
+                            continue;
+                        waydroid::sensor_event_init(event, i).timestamp =
+                            int64_t(j) * MAX_NUM_SENSORS + i;
+                        dev->events[i].push(event);
+                    }
+                }
+
+                auto const start = Clock::now();
+                if (mask) {
+                    while (sensor_device_pick_pending_event_locked(dev, &event) >= 0)
+                        keep(event);
+                } else {
+                    for (size_t j = 0; j < kPendingPerSensor; j++)
+                        keep(sensor_device_pick_pending_event_locked(dev, &event));
+                }
+                spent += elapsed_ns(start);
+            }
+            return spent;
+        }, NULL };
+}
+
+/* Both ends of a sensord data connection, the reader connected through
+ * SENSORFW_SOCKET_PATH like a channel does */
+struct DataSocket {
+    DataSocket() : dir(NULL), listenFd(-1), serverFd(-1) {}
+
+    ~DataSocket() {
+        reader.dropConnection();
+        if (serverFd >= 0)
+            close(serverFd);
+        if (listenFd >= 0)
+            close(listenFd);
+        if (dir) {
+            unlink(path.c_str());
+            g_rmdir(dir);
+            g_free(dir);
+        }
+    }
+
+    bool open() {
+        dir = g_dir_make_tmp("waydroid-sensors-XXXXXX", NULL);
+        if (!dir)
+            return false;
+        path = std::string(dir) + "/sensord.sock";
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0 ||
+            bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(listenFd, 1) < 0)
+            return false;
+        setenv("SENSORFW_SOCKET_PATH", path.c_str(), 1);
+
+        /* The reader sends its session id and waits for the tag */
+        std::thread server([this] {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            int id;
+            char const tag = '\n';
+            if (fd >= 0 && (recv(fd, &id, sizeof(id), MSG_WAITALL) != sizeof(id) ||
+                            send(fd, &tag, 1, MSG_NOSIGNAL) != 1)) {
+                close(fd);
+                fd = -1;
+            }
+            serverFd = fd;
+        });
+        bool const connected = reader.initiateConnection(1);
+        if (!connected)
+            shutdown(listenFd, SHUT_RDWR);
+        server.join();
+
+        return connected && serverFd >= 0;
+    }
+
+    gchar* dir;
+    std::string path;
+    int listenFd;
+    int serverFd;
+    SocketReader reader;
+};
+
+/* SocketReader::read() of frames of |batch| samples already waiting */
+template<int Id>
+Benchmark socket_read_benchmark(DataSocket* socket, uint32_t batch) {
+    typedef typename SensorTraits<Id>::Sample Sample;
+
+    size_t const frameSize = sizeof(batch) + batch * sizeof(Sample);
+    auto frames = std::make_shared<std::vector<char>>(kFrames * frameSize);
+    auto samples = make_samples<Sample>(batch);
+    for (size_t f = 0; f < kFrames; f++) {
+        char* frame = frames->data() + f * frameSize;
+        memcpy(frame, &batch, sizeof(batch));
+        memcpy(frame + sizeof(batch), samples.get(), batch * sizeof(Sample));
+    }
+
+    return { std::string("socket_read/") + kSensorTable[Id].tag + "/" + std::to_string(batch),
+        "sample", kFrames * batch,
+        [socket, frames](uint64_t iterations) {
+            waydroid::core::SampleSpan<Sample> values;
+            int64_t spent = 0;
+
+            for (uint64_t n = 0; n < iterations; n++) {
+                size_t written = 0;
+                while (written < frames->size()) {
+                    ssize_t const ret = send(socket->serverFd, frames->data() + written,
+                                             frames->size() - written, MSG_NOSIGNAL);
+                    if (ret <= 0)
+                        return int64_t(-1);
+                    written += ret;
+                }
+
+                auto const start = Clock::now();
+                for (size_t f = 0; f < kFrames; f++) {
+                    socket->reader.read<Sample>(values);
+                    keep(values);
+                }
+                spent += elapsed_ns(start);
+            }
+            return spent;
+        }, socket->serverFd >= 0 ? NULL : "no sensord socket" };
+}
+
+/* A whole POLL reply of |count| events: the reply, its event buffer, the
+ * events written into it as Sensors::poll() does, and the serialization */
+Benchmark poll_reply_benchmark(GBinderLocalObject* obj, size_t count) {
+    auto canned = std::make_shared<std::vector<sensors_event_t>>(count);
+    for (size_t i = 0; i < count; i++)
+        waydroid::sensor_event_init((*canned)[i], ID_ACCELEROMETER).timestamp = i;
+
+    return { "poll_reply/" + std::to_string(count), "event", count,
+        [obj, canned](uint64_t iterations) {
+            size_t const capacity = Sensors::pollBufferSize(INT32_MAX);
+            auto const start = Clock::now();
+
+            for (uint64_t n = 0; n < iterations; n++) {
+                GBinderLocalReply* reply = gbinder_local_object_new_reply(obj);
+                GBinderWriter writer;
+
+                gbinder_local_reply_init_writer(reply, &writer);
+                sensors_event_t* events = poll_reply_alloc_events(&writer, capacity);
+                memcpy(events, canned->data(), canned->size() * sizeof(sensors_event_t));
+                poll_reply_write(&writer, RESULT_OK, events, canned->size());
+                gbinder_local_reply_unref(reply);
+            }
+            return elapsed_ns(start);
+        }, obj ? NULL : "no binder device" };
+}
+
+void run_benchmark(Benchmark const& b) {
+    if (b.skipped) {
+        printf("{\"name\":\"%s\",\"skipped\":\"%s\"}\n", b.name.c_str(), b.skipped);
+        return;
+    }
+
+    /* Calibrate the iterations of a round */
+    uint64_t iterations = 1;
+    for (;;) {
+        int64_t const ns = b.run(iterations);
+        if (ns < 0) {
+            printf("{\"name\":\"%s\",\"skipped\":\"failed\"}\n", b.name.c_str());
+            return;
+        }
+        if (ns >= kMinRoundNs)
+            break;
+        iterations *= ns > 0 ? std::min<int64_t>(10, kMinRoundNs / ns + 1) : 10;
+    }
+
+    std::vector<double> perItem;
+    for (int r = 0; r < opt_rounds; r++)
+        perItem.push_back(double(b.run(iterations)) / (double(iterations) * b.items));
+    std::sort(perItem.begin(), perItem.end());
+
+    printf("{\"name\":\"%s\",\"unit\":\"ns\",\"per\":\"%s\",\"median\":%.3f,"
+           "\"min\":%.3f,\"iterations\":%llu,\"items\":%zu,\"rounds\":%d}\n",
+           b.name.c_str(), b.per, perItem[perItem.size() / 2], perItem.front(),
+           (unsigned long long)iterations, b.items, opt_rounds);
+    fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    gutil_log_timestamp = FALSE;
+    gutil_log_set_type(GLOG_TYPE_STDERR, "sensors-microbenchmark");
+    gutil_log_default.level = GLOG_LEVEL_ERR;
+
+    GError* error = NULL;
+    GOptionContext* options = g_option_context_new("- microbenchmark the HAL hot path");
+    g_option_context_add_main_entries(options, kOptions, NULL);
+    gboolean parsed = g_option_context_parse(options, &argc, &argv, &error);
+    g_option_context_free(options);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    if (opt_rounds < 1) {
+        fprintf(stderr, "At least one round is needed\n");
+        return 1;
+    }
+
+    /* The event path only, without sensorfw behind it */
+    std::unique_ptr<SensorDevice> dev(new SensorDevice());
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_mutex_init(&dev->direct_lock, NULL);
+    pthread_mutex_init(&dev->fusion_lock, NULL);
+    /* The virtual sensors are measured on their own */
+    dev->active_sensors = SENSORFW_SENSORS;
+
+    DataSocket socket;
+    if (!socket.open())
+        fprintf(stderr, "Can't set up a sensord socket, skipping socket_read\n");
+
+    GBinderServiceManager* sm = gbinder_servicemanager_new2(
+        opt_device ? opt_device : "/dev/anbox-hwbinder", "hidl", "hidl");
+    GBinderLocalObject* obj = sm ? gbinder_servicemanager_new_local_object(sm,
+        "android.hardware.sensors@1.0::ISensors", NULL, NULL) : NULL;
+
+    std::vector<Benchmark> benchmarks = {
+        convert_benchmark<ID_ACCELEROMETER>(),
+        convert_benchmark<ID_GYROSCOPE>(),
+        convert_benchmark<ID_HUMIDITY>(),
+        convert_benchmark<ID_LIGHT>(),
+        convert_benchmark<ID_MAGNETIC_FIELD>(),
+        convert_benchmark<ID_DEVICE_ORIENTATION>(),
+        convert_benchmark<ID_PRESSURE>(),
+        convert_benchmark<ID_PROXIMITY>(),
+        convert_benchmark<ID_STEPCOUNTER>(),
+        convert_benchmark<ID_TEMPERATURE>(),
+
+        event_cb_benchmark<ID_ACCELEROMETER>(dev.get()),
+        event_cb_benchmark<ID_GYROSCOPE>(dev.get()),
+        event_cb_benchmark<ID_MAGNETIC_FIELD>(dev.get()),
+        event_cb_benchmark<ID_LIGHT>(dev.get()),
+
+        fusion_benchmark(dev.get(), "imu", SENSORFW_SENSORS),
+        fusion_benchmark(dev.get(), "gravity+linear-acceleration", SENSORFW_SENSORS |
+                         SENSORS_GRAVITY | SENSORS_LINEAR_ACCELERATION),
+        fusion_benchmark(dev.get(), "game-rotation-vector",
+                         SENSORFW_SENSORS | SENSORS_GAME_ROTATION_VECTOR),
+        fusion_benchmark(dev.get(), "rotation-vector",
+                         SENSORFW_SENSORS | SENSORS_ROTATION_VECTOR),
+        fusion_benchmark(dev.get(), "geomagnetic-rotation-vector",
+                         SENSORFW_SENSORS | SENSORS_GEOMAGNETIC_ROTATION_VECTOR),
+        fusion_benchmark(dev.get(), "all", SUPPORTED_SENSORS),
+
+        pick_benchmark(dev.get(), "none", 0),
+        pick_benchmark(dev.get(), "accelerometer", SENSORS_ACCELEROMETER),
+        pick_benchmark(dev.get(), "accelerometer+gyroscope",
+                       SENSORS_ACCELEROMETER | SENSORS_GYROSCOPE),
+        pick_benchmark(dev.get(), "imu",
+                       SENSORS_ACCELEROMETER | SENSORS_GYROSCOPE |
+                       SENSORS_MAGNETIC_FIELD | SENSORS_MAGNETIC_FIELD_UNCALIBRATED),
+        pick_benchmark(dev.get(), "all", SUPPORTED_SENSORS),
+
+        socket_read_benchmark<ID_ACCELEROMETER>(&socket, 1),
+        socket_read_benchmark<ID_ACCELEROMETER>(&socket, 16),
+        socket_read_benchmark<ID_MAGNETIC_FIELD>(&socket, 1),
+        socket_read_benchmark<ID_LIGHT>(&socket, 1),
+
+        poll_reply_benchmark(obj, 1),
+        poll_reply_benchmark(obj, 16),
+        poll_reply_benchmark(obj, 128),
+    };
+
+    for (auto const& b : benchmarks) {
+        if (!opt_filter || b.name.find(opt_filter) != std::string::npos)
+            run_benchmark(b);
+    }
+
+    if (obj)
+        gbinder_local_object_unref(obj);
+    if (sm)
+        gbinder_servicemanager_unref(sm);
+    return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Streams sensors from a stand-in sensord through SensorFW and Sensors::poll
+ * and reports how long events take from the data socket to POLL, how many
+ * get through per second and how many are lost on the way. Runs offline,
+ * on a private bus.
+ */
+
+#include "fake_sensord.h"
+#include "Sensors.h"
+#include "SensorTable.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using waydroid::benchmarks::FakePlugin;
+using waydroid::benchmarks::FakeSensord;
+using waydroid::benchmarks::fake_plugin;
+using waydroid::sensors::implementation::Sensors;
+
+namespace {
+
+/* Events asked for per POLL, like the framework does */
+constexpr int32_t kPollCount = 128;
+/* Time given to events still on their way after the sensors are stopped */
+constexpr auto kDrainTime = std::chrono::milliseconds(500);
+
+gchar* opt_sensors = NULL;
+gint opt_rate = 200;
+gint opt_batch = 1;
+gint opt_duration = 10;
+gint opt_latency_ms = 0;
+
+const GOptionEntry kOptions[] = {
+    { "sensors", 's', 0, G_OPTION_ARG_STRING, &opt_sensors,
+      "Comma separated sensors to stream [accelerometer,gyroscope]", "LIST" },
+    { "rate", 'r', 0, G_OPTION_ARG_INT, &opt_rate,
+      "Sampling rate in Hz, a divisor of 1000 [200]", "HZ" },
+    { "batch", 'b', 0, G_OPTION_ARG_INT, &opt_batch,
+      "Samples per sensord socket frame [1]", "N" },
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration,
+      "Seconds to stream for [10]", "SEC" },
+    { "latency", 'l', 0, G_OPTION_ARG_INT, &opt_latency_ms,
+      "maxReportLatency passed to BATCH, in ms [0]", "MS" },
+    { NULL }
+};
+
+/* The plugin a handle is served by */
+template<int Id>
+FakePlugin handle_plugin() {
+    return fake_plugin<typename waydroid::SensorTraits<
+        waydroid::SensorChannel<Id>::value>::Plugin>();
+}
+
+template<int... Ids>
+std::vector<FakePlugin> handle_plugins(std::integer_sequence<int, Ids...>) {
+    return { handle_plugin<Ids>()... };
+}
+
+/* The sensorfw handle whose samples produce the events of |id| */
+int sensor_trigger(int id) {
+    switch (id) {
+    case ID_GAME_ROTATION_VECTOR:
+    case ID_ROTATION_VECTOR:
+    case ID_GYROSCOPE_UNCALIBRATED:
+        return ID_GYROSCOPE;
+    default:
+        return id >= NUM_SENSORFW_SENSORS ? ID_ACCELEROMETER : id;
+    }
+}
+
+struct PollStats {
+    std::atomic<bool> stop;
+    std::atomic<uint64_t> received[MAX_NUM_SENSORS];
+    /* Nanoseconds from sample to POLL, owned by the poll thread */
+    std::vector<int64_t> latency[MAX_NUM_SENSORS];
+};
+
+int64_t boottime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+void poll_events(Sensors* sensors, PollStats* stats) {
+    std::vector<sensors_event_t> events(Sensors::pollBufferSize(kPollCount));
+
+    while (!stats->stop.load()) {
+        int err = RESULT_OK;
+        size_t const count = sensors->poll(kPollCount, events.data(), &err);
+        int64_t const now = boottime_ns();
+
+        for (size_t i = 0; i < count; i++) {
+            sensors_event_t const& event = events[i];
+            if (event.sensorType == SENSOR_TYPE_META_DATA || !ID_CHECK(event.sensorHandle))
+                continue;
+
+            stats->latency[event.sensorHandle].push_back(now - event.timestamp);
+            stats->received[event.sensorHandle].fetch_add(1);
+        }
+    }
+}
+
+int64_t percentile(std::vector<int64_t> const& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+bool parse_sensors(const char* list, std::vector<int>* handles) {
+    gchar** names = g_strsplit(list, ",", -1);
+    bool ok = true;
+
+    for (gchar** name = names; *name && ok; name++) {
+        auto const descriptor = std::find_if(
+            std::begin(waydroid::kSensorTable), std::end(waydroid::kSensorTable),
+            [name](waydroid::SensorDescriptor const& d) { return strcmp(d.tag, *name) == 0; });
+
+        if (descriptor == std::end(waydroid::kSensorTable)) {
+            fprintf(stderr, "Unknown sensor \"%s\"\n", *name);
+            ok = false;
+        } else {
+            handles->push_back(descriptor->id);
+        }
+    }
+
+    g_strfreev(names);
+    return ok && !handles->empty();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    gutil_log_timestamp = FALSE;
+    gutil_log_set_type(GLOG_TYPE_STDERR, "sensors-e2e-benchmark");
+    gutil_log_default.level = GLOG_LEVEL_ERR;
+
+    GError* error = NULL;
+    GOptionContext* options = g_option_context_new("- benchmark the HAL against a stand-in sensord");
+    g_option_context_add_main_entries(options, kOptions, NULL);
+    gboolean parsed = g_option_context_parse(options, &argc, &argv, &error);
+    g_option_context_free(options);
+    if (!parsed) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    std::vector<int> handles;
+    if (!parse_sensors(opt_sensors ? opt_sensors : "accelerometer,gyroscope", &handles))
+        return 1;
+    if (opt_rate < 1 || opt_rate > 1000 || opt_batch < 1 || opt_batch > 1000 ||
+        opt_duration < 1 || opt_latency_ms < 0) {
+        fprintf(stderr, "Rate must be 1..1000 Hz, batch 1..1000 samples, duration at least 1 s\n");
+        return 1;
+    }
+    /* sensord takes intervals in whole milliseconds, anything else would
+     * silently run at another rate than the one reported */
+    if (1000 % opt_rate) {
+        fprintf(stderr, "Rate must divide 1000 Hz, sensord intervals are in ms\n");
+        return 1;
+    }
+
+    /* Serve every plugin the HAL probes, like a complete device would */
+    auto const byHandle = handle_plugins(std::make_integer_sequence<int, NUM_SENSORFW_SENSORS>());
+    std::vector<FakePlugin> plugins;
+    for (auto const& plugin : byHandle) {
+        if (std::none_of(plugins.begin(), plugins.end(),
+                [&plugin](FakePlugin const& p) { return strcmp(p.name, plugin.name) == 0; }))
+            plugins.push_back(plugin);
+    }
+
+    FakeSensord sensord(plugins, opt_batch, 1000 / opt_rate);
+    if (!sensord.ok())
+        return 1;
+
+    /* Like the service, Sensors lives until the process exits */
+    Sensors* sensors = new Sensors();
+    PollStats stats;
+    stats.stop = false;
+    for (auto& received : stats.received)
+        received = 0;
+
+    for (int handle : handles) {
+        sensors->batch(handle, 1000000000LL / opt_rate, opt_latency_ms * 1000000LL);
+        if (sensors->activate(handle, true) != RESULT_OK) {
+            fprintf(stderr, "Failed to activate %s\n", waydroid::kSensorTable[handle].tag);
+            return 1;
+        }
+    }
+
+    std::thread poller(poll_events, sensors, &stats);
+    auto const start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(opt_duration));
+
+    uint64_t inWindow[MAX_NUM_SENSORS] = { 0 };
+    for (int handle : handles) {
+        inWindow[handle] = stats.received[handle].load();
+        sensors->activate(handle, false);
+    }
+    double const seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::this_thread::sleep_for(kDrainTime);
+    stats.stop = true;
+    sensors->killLoops();
+    poller.join();
+
+    printf("rate %d Hz, batch %d, latency %d ms, %.1f s\n",
+           opt_rate, opt_batch, opt_latency_ms, seconds);
+    printf("%-28s %10s %10s %10s %8s %8s %9s %9s %9s %9s %9s\n",
+           "sensor", "received", "events/s", "sent", "dropped", "lost",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+    for (int handle : handles) {
+        /* Several handles can share a channel, counters are per plugin.
+         * Virtual sensors count against the sensor that triggers them. */
+        const char* plugin = byHandle[sensor_trigger(handle)].name;
+        auto& latency = stats.latency[handle];
+        std::sort(latency.begin(), latency.end());
+
+        uint64_t const received = stats.received[handle].load();
+        uint64_t const sent = sensord.sent(plugin);
+        printf("%-28s %10llu %10.1f %10llu %8llu %8lld %9lld %9lld %9lld %9lld %9lld\n",
+               waydroid::kSensorTable[handle].tag,
+               (unsigned long long)received,
+               inWindow[handle] / seconds,
+               (unsigned long long)sent,
+               (unsigned long long)sensord.dropped(plugin),
+               (long long)(sent - received),
+               (long long)percentile(latency, 0.5) / 1000,
+               (long long)percentile(latency, 0.9) / 1000,
+               (long long)percentile(latency, 0.99) / 1000,
+               (long long)percentile(latency, 0.999) / 1000,
+               (long long)(latency.empty() ? 0 : latency.back()) / 1000);
+    }
+
+    return 0;
+}
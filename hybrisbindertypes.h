@@ -111,6 +111,15 @@ enum {
     SENSOR_FLAG_MASK_DIRECT_CHANNEL = 3072u, // 0xC00
 };
 
+enum {
+    SENSOR_FLAG_SHIFT_REPORTING_MODE = 1u, // 1
+    SENSOR_FLAG_SHIFT_DATA_INJECTION = 4u, // 4
+    SENSOR_FLAG_SHIFT_DYNAMIC_SENSOR = 5u, // 5
+    SENSOR_FLAG_SHIFT_ADDITIONAL_INFO = 6u, // 6
+    SENSOR_FLAG_SHIFT_DIRECT_REPORT = 7u, // 7
+    SENSOR_FLAG_SHIFT_DIRECT_CHANNEL = 10u, // 10
+};
+
 struct sensor_t {
     int32_t handle ALIGNED(4);
     gbinder_hidl_string name ALIGNED(8);
@@ -263,6 +272,24 @@ enum class RateLevel : int32_t {
     VERY_FAST = 3,
 };
 
+enum class SharedMemType : uint32_t {
+    ASHMEM = 1u, // 1
+    GRALLOC = 2u, // 2
+};
+
+enum class SharedMemFormat : uint32_t {
+    SENSORS_EVENT = 1u, // 1
+};
+
+struct SharedMemInfo {
+    SharedMemType type ALIGNED(4);
+    SharedMemFormat format ALIGNED(4);
+    uint32_t size ALIGNED(4);
+    GBinderHidlHandle memoryHandle ALIGNED(8);
+} ALIGNED(8);
+
+static_assert(sizeof(SharedMemInfo) == 32, "wrong size");
+
 enum class SensorsEventFormatOffset : uint16_t {
     SIZE_FIELD = 0, // 0x0
     REPORT_TOKEN = 4, // 0x4
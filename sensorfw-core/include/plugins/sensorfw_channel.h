@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2020 UBports foundation
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <utils/handler_registration.h>
+#include <utils/handler_slot.h>
+#include <utils/sample_span.h>
+#include <plugins/sensorfw_common.h>
+#include <datatypes/liddata.h>
+#include <datatypes/orientationdata.h>
+#include <datatypes/posedata.h>
+#include <datatypes/tapdata.h>
+#include <datatypes/timedunsigned.h>
+
+namespace waydroid
+{
+namespace core
+{
+
+/* DBus names of a sensorfw plugin */
+template<Sensorfw::PluginType P> struct SensorfwPlugin;
+
+#define SENSORFW_PLUGIN(type, name, iface) \
+    template<> struct SensorfwPlugin<Sensorfw::type> \
+    { \
+        static constexpr char const* string() { return name; } \
+        static constexpr char const* interface() { return iface; } \
+    };
+
+SENSORFW_PLUGIN(ACCELEROMETER, "accelerometersensor", "local.AccelerometerSensor")
+SENSORFW_PLUGIN(COMPASS, "compasssensor", "local.CompassSensor")
+SENSORFW_PLUGIN(GYROSCOPE, "gyroscopesensor", "local.GyroscopeSensor")
+SENSORFW_PLUGIN(HUMIDITY, "humiditysensor", "local.HumiditySensor")
+SENSORFW_PLUGIN(LID, "lidsensor", "local.LidSensor")
+SENSORFW_PLUGIN(LIGHT, "alssensor", "local.ALSSensor")
+SENSORFW_PLUGIN(MAGNETOMETER, "magnetometersensor", "local.MagnetometerSensor")
+SENSORFW_PLUGIN(ORIENTATION, "orientationsensor", "local.OrientationSensor")
+SENSORFW_PLUGIN(PRESSURE, "pressuresensor", "local.PressureSensor")
+SENSORFW_PLUGIN(PROXIMITY, "proximitysensor", "local.ProximitySensor")
+SENSORFW_PLUGIN(ROTATION, "rotationsensor", "local.RotationSensor")
+SENSORFW_PLUGIN(STEPCOUNTER, "stepcountersensor", "local.StepCounterSensor")
+SENSORFW_PLUGIN(TAP, "tapsensor", "local.TapSensor")
+SENSORFW_PLUGIN(TEMPERATURE, "temperaturesensor", "local.TemperatureSensor")
+
+#undef SENSORFW_PLUGIN
+
+/*
+ * A sensorfw channel streaming samples of type T from plugin P.
+ *
+ * Samples are passed to a sink, a plain function pointer with its user
+ * data, on the event loop of the channel. The sink is bound when it gets
+ * registered, so the data path does not go through virtual calls or
+ * std::function. Registering and unregistering take effect right away,
+ * from any thread.
+ */
+template<typename T, Sensorfw::PluginType P>
+class SensorfwChannel : public Sensorfw
+{
+public:
+    typedef T Sample;
+    /* Receives the samples of one socket read, valid for the call only */
+    typedef void (*Sink)(void* userdata, SampleSpan<T> samples);
+
+    SensorfwChannel(std::shared_ptr<DBusConnectionHandle> const& dbus_connection, EventLoop& event_loop);
+
+    HandlerRegistration register_sink(Sink sink, void* userdata);
+
+    void enable_events();
+    void disable_events();
+
+private:
+    struct Binding
+    {
+        Sink sink;
+        void* userdata;
+    };
+
+    static void data_received(Sensorfw* self);
+    static void null_sink(void*, SampleSpan<T>) {}
+
+    HandlerSlot<Binding> sink;
+};
+
+using SensorfwAccelerometerSensor = SensorfwChannel<AccelerationData, Sensorfw::ACCELEROMETER>;
+using SensorfwCompassSensor = SensorfwChannel<CompassData, Sensorfw::COMPASS>;
+using SensorfwGyroscopeSensor = SensorfwChannel<TimedXyzData, Sensorfw::GYROSCOPE>;
+using SensorfwHumiditySensor = SensorfwChannel<TimedUnsigned, Sensorfw::HUMIDITY>;
+using SensorfwLidSensor = SensorfwChannel<LidData, Sensorfw::LID>;
+using SensorfwLightSensor = SensorfwChannel<TimedUnsigned, Sensorfw::LIGHT>;
+using SensorfwMagnetometerSensor = SensorfwChannel<CalibratedMagneticFieldData, Sensorfw::MAGNETOMETER>;
+using SensorfwOrientationSensor = SensorfwChannel<PoseData, Sensorfw::ORIENTATION>;
+using SensorfwPressureSensor = SensorfwChannel<TimedUnsigned, Sensorfw::PRESSURE>;
+using SensorfwProximitySensor = SensorfwChannel<ProximityData, Sensorfw::PROXIMITY>;
+using SensorfwRotationSensor = SensorfwChannel<TimedXyzData, Sensorfw::ROTATION>;
+using SensorfwStepcounterSensor = SensorfwChannel<TimedUnsigned, Sensorfw::STEPCOUNTER>;
+using SensorfwTapSensor = SensorfwChannel<TapData, Sensorfw::TAP>;
+using SensorfwTemperatureSensor = SensorfwChannel<TimedUnsigned, Sensorfw::TEMPERATURE>;
+
+template<typename T, Sensorfw::PluginType P>
+SensorfwChannel<T, P>::SensorfwChannel(
+    std::shared_ptr<DBusConnectionHandle> const& dbus_connection, EventLoop& event_loop)
+    : Sensorfw(dbus_connection, event_loop,
+               SensorfwPlugin<P>::string(), SensorfwPlugin<P>::interface(),
+               &SensorfwChannel::data_received),
+      sink{Binding{null_sink, nullptr}}
+{
+}
+
+template<typename T, Sensorfw::PluginType P>
+HandlerRegistration SensorfwChannel<T, P>::register_sink(Sink sink, void* userdata)
+{
+    return this->sink.bind(Binding{sink, userdata});
+}
+
+template<typename T, Sensorfw::PluginType P>
+void SensorfwChannel<T, P>::enable_events()
+{
+    open_session().get();
+
+    /* Waits for sensorfw here, not on the event loop */
+    std::future<void> started;
+    dbus_event_loop.enqueue(
+        [this, &started]
+        {
+            started = start();
+        }).get();
+    started.get();
+}
+
+template<typename T, Sensorfw::PluginType P>
+void SensorfwChannel<T, P>::disable_events()
+{
+    dbus_event_loop.enqueue(
+        [this]
+        {
+            stop();
+        }).get();
+}
+
+template<typename T, Sensorfw::PluginType P>
+void SensorfwChannel<T, P>::data_received(Sensorfw* self)
+{
+    auto const channel = static_cast<SensorfwChannel*>(self);
+
+    SampleSpan<T> values;
+    if (!channel->m_socket->template read<T>(values))
+        return;
+
+    channel->sink.dispatch([&values](Binding const& binding)
+        {
+            binding.sink(binding.userdata, values);
+        });
+}
+
+}
+}
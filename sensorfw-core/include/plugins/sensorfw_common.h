@@ -18,12 +18,13 @@
  * Authored by: Erfan Abdi <erfangplus@gmail.com>
  */
 
+#include <future>
 #include <memory>
 #include <string>
 #include <thread>
 
 #include <utils/dbus_connection_handle.h>
-#include <utils/event_loop_handler_registration.h>
+#include <utils/event_loop.h>
 #include <utils/socketreader.h>
 
 #include <gutil_log.h>
@@ -53,27 +54,65 @@ public:
         TEMPERATURE
     };
 
+    /* Reads the pending samples off the data socket of a channel */
+    typedef void (*DataHandler)(Sensorfw* self);
+
     Sensorfw(
-        std::string const& dbus_bus_address,
-        std::string const& name,
-        PluginType const& plugin);
-    virtual ~Sensorfw();
+        std::shared_ptr<DBusConnectionHandle> const& dbus_connection,
+        EventLoop& event_loop,
+        char const* plugin_name,
+        char const* interface_name,
+        DataHandler data_handler);
+    ~Sensorfw();
+
+    /*
+     * Loads the sensorfw plugin without blocking the event loop, so many
+     * channels can be probed in parallel. The future fails if the plugin
+     * is missing. No session is created until the channel is enabled.
+     */
+    std::future<void> probe();
+
+    /*
+     * Asks sensorfw for one sample every interval milliseconds. The rate is
+     * remembered and applied whenever a session gets opened. 0 withdraws
+     * the request and leaves the rate to sensord.
+     */
+    void request_interval(int interval);
 
 protected:
-    virtual void data_recived_impl() = 0;
+    /*
+     * Requests the sensorfw session and connects its data socket unless
+     * that was already done. Sessions are released again once the channel
+     * stayed stopped for WAYDROID_SENSORS_IDLE_RELEASE_MS.
+     */
+    std::future<void> open_session();
 
+    /*
+     * The sensorfw control calls do not block the event loop they are made
+     * on, it serves the data sockets of other channels too. Calls are sent
+     * in order, start() resolves once sensorfw acknowledged the start.
+     */
     void set_interval(int interval = 10);
-    void start();
+    std::future<void> start();
     void stop();
 
-    DBusConnectionHandle dbus_connection;
-    EventLoop dbus_event_loop;
+    std::shared_ptr<DBusConnectionHandle> const dbus_connection;
+    EventLoop& dbus_event_loop;
     std::shared_ptr<SocketReader> m_socket;
 
 private:
-    void request_sensor();
-    bool release_sensor();
-    bool load_plugin();
+    struct OpenContext;
+
+    void load_plugin(OpenContext* ctx);
+    void request_sensor(OpenContext* ctx);
+    void connect_socket(OpenContext* ctx);
+    void release_sensor();
+    void schedule_release();
+    void close_session();
+
+    static void static_plugin_loaded(GObject* source, GAsyncResult* result, gpointer user_data);
+    static void static_sensor_requested(GObject* source, GAsyncResult* result, gpointer user_data);
+    static void static_started(GObject* source, GAsyncResult* result, gpointer user_data);
 
     const char* plugin_string() const;
     const char* plugin_interface() const;
@@ -81,10 +120,15 @@ private:
 
     static gboolean static_data_recieved(GSocket * socket, GIOCondition cond, gpointer user_data);
 
-    PluginType m_plugin;
+    char const* const m_plugin_string;
+    char const* const m_plugin_interface;
+    DataHandler const m_data_handler;
     std::unique_ptr<char, decltype(&free)> m_pluginPath;
     pid_t m_pid;
     int m_sessionid;
+    int m_interval;
+    unsigned m_release_generation;
+    std::shared_ptr<int> m_lifetime;
     std::unique_ptr<GSource, decltype(&g_source_unref)> m_gsource;
 };
 }
@@ -0,0 +1,70 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace waydroid
+{
+namespace core
+{
+
+/*
+ * Maps timestamps of a remote clock to the local clock, both in
+ * nanoseconds, from pairs of (remote acquisition time, local arrival time).
+ *
+ * The arrival time of a sample is its acquisition time plus a delivery
+ * delay that is never negative, so the smallest observed offset is the best
+ * estimate of the clock offset. The estimator follows that lower envelope
+ * and tracks the drift between the clocks from its slope, so samples can
+ * be stamped with their acquisition time instead of their arrival time.
+ *
+ * Not thread safe, use one instance per sample stream.
+ */
+class ClockSync
+{
+public:
+    ClockSync();
+
+    /* Local time of a sample taken at |remote| that arrived at |arrival| */
+    int64_t to_local(int64_t remote, int64_t arrival);
+
+    int64_t offset() const { return base_offset; }
+    /* Drift of the remote clock, in parts per billion */
+    int64_t drift_ppb() const { return drift; }
+
+private:
+    int64_t predict(int64_t remote) const;
+    void reset(int64_t remote, int64_t offset);
+
+    bool synced;
+    int64_t base_remote;
+    int64_t base_offset;
+    int64_t drift;
+
+    /* Lowest offset seen in the current window and when it was seen */
+    int64_t window_start;
+    int64_t window_min;
+    int64_t window_min_remote;
+    /* Lowest offset of the first window since the last reset */
+    bool anchored;
+    int64_t anchor_min;
+    int64_t anchor_remote;
+};
+
+}
+}
@@ -1,5 +1,4 @@
 /*
- * Copyright © 2020 UBports foundation
  * Copyright © 2021 Waydroid Project.
  *
  * This program is free software: you can redistribute it and/or modify it
@@ -13,39 +12,42 @@
  *
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
- *
- * Authored by: Marius Gripsgard <marius@ubports.com>
- * Authored by: Erfan Abdi <erfangplus@gmail.com>
  */
 
 #pragma once
 
-#include <utils/handler_registration.h>
-#include <plugins/sensorfw_common.h>
-#include <datatypes/liddata.h>
+#include <utils/event_loop.h>
+
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace waydroid
 {
 namespace core
 {
 
-using LidHandler = std::function<void(LidData)>;
-
-class SensorfwLidSensor : public Sensorfw
+/*
+ * Fixed set of event loops shared by all sensorfw channels. A channel is
+ * bound to one loop for its whole life, which keeps its data and control
+ * calls ordered while the pool multiplexes many channels per thread.
+ */
+class EventLoopPool
 {
 public:
-    SensorfwLidSensor(std::string const& dbus_bus_address);
+    EventLoopPool(std::string const& name, size_t size);
 
-    HandlerRegistration register_lid_handler(
-        LidHandler const& handler);
+    size_t size() const;
 
-    void enable_lid_events();
-    void disable_lid_events();
+    /* Hands out the loops in round-robin order */
+    EventLoop& next();
 
 private:
-    void data_recived_impl();
+    EventLoopPool(EventLoopPool const&) = delete;
+    EventLoopPool& operator=(EventLoopPool const&) = delete;
 
-    LidHandler handler;
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    size_t next_loop;
 };
 
 }
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <utils/handler_registration.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace waydroid
+{
+namespace core
+{
+
+/*
+ * Holds the handler an event loop dispatches to, swappable from any thread
+ * without a round trip through the loop.
+ *
+ * The handler is published through an atomic pointer. dispatch() announces
+ * itself in a reader count before loading it, so a replaced handler is only
+ * freed once no dispatch can still be using it. Once bind() returns or a
+ * registration is destroyed, the old handler is not called anymore.
+ *
+ * Writers are serialized by a mutex, dispatch() never blocks. A registration
+ * must not be destroyed from within the handler it unbinds.
+ */
+template<typename Handler>
+class HandlerSlot
+{
+public:
+    explicit HandlerSlot(Handler const& null_handler)
+        : null_handler{null_handler},
+          current{new Entry{null_handler, 0}},
+          readers{0},
+          next_id{1}
+    {
+    }
+
+    ~HandlerSlot()
+    {
+        delete current.load();
+    }
+
+    /* Makes |handler| current until the returned registration is destroyed */
+    HandlerRegistration bind(Handler const& handler)
+    {
+        std::lock_guard<std::mutex> lock{writer};
+        auto const id = next_id++;
+        publish(new Entry{handler, id});
+
+        return HandlerRegistration{[this, id]
+            {
+                std::lock_guard<std::mutex> lock{writer};
+                /* Replaced by a newer binding in the meantime */
+                if (current.load()->id == id)
+                    publish(new Entry{this->null_handler, 0});
+            }};
+    }
+
+    /* Calls |f| with the current handler. Never blocks. */
+    template<typename F>
+    void dispatch(F&& f)
+    {
+        readers.fetch_add(1);
+        f(current.load()->handler);
+        readers.fetch_sub(1);
+    }
+
+private:
+    HandlerSlot(HandlerSlot const&) = delete;
+    HandlerSlot& operator=(HandlerSlot const&) = delete;
+
+    struct Entry
+    {
+        Handler handler;
+        unsigned long id;
+    };
+
+    /* Swaps in |entry| and frees the previous one after the grace period */
+    void publish(Entry* entry)
+    {
+        auto const old = current.exchange(entry);
+
+        /* A dispatch counted from here on loads |entry|, so only the ones
+         * already running can hold |old|. They finish in one callback. */
+        while (readers.load() != 0)
+            std::this_thread::yield();
+
+        delete old;
+    }
+
+    Handler const null_handler;
+    std::atomic<Entry*> current;
+    std::atomic<unsigned> readers;
+    std::mutex writer;
+    unsigned long next_id;
+};
+
+}
+}
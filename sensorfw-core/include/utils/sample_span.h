@@ -1,5 +1,4 @@
 /*
- * Copyright © 2020 UBports foundation
  * Copyright © 2021 Waydroid Project.
  *
  * This program is free software: you can redistribute it and/or modify it
@@ -13,39 +12,42 @@
  *
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
- *
- * Authored by: Marius Gripsgard <marius@ubports.com>
- * Authored by: Erfan Abdi <erfangplus@gmail.com>
  */
 
 #pragma once
 
-#include <utils/handler_registration.h>
-#include <plugins/sensorfw_common.h>
-#include <datatypes/orientationdata.h>
+#include <cstddef>
 
 namespace waydroid
 {
 namespace core
 {
 
-using AccelerometerHandler = std::function<void(AccelerationData)>;
-
-class SensorfwAccelerometerSensor : public Sensorfw
+/*
+ * Read-only view of a contiguous batch of samples. The view does not own
+ * the samples, it is only valid for the duration of the handler call it
+ * was passed to.
+ */
+template<typename T>
+class SampleSpan
 {
 public:
-    SensorfwAccelerometerSensor(std::string const& dbus_bus_address);
+    SampleSpan() : ptr{nullptr}, count{0} {}
+    SampleSpan(T const* data, size_t size) : ptr{data}, count{size} {}
 
-    HandlerRegistration register_accelerometer_handler(
-        AccelerometerHandler const& handler);
+    T const* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
 
-    void enable_accelerometer_events();
-    void disable_accelerometer_events();
+    T const* begin() const { return ptr; }
+    T const* end() const { return ptr + count; }
 
-private:
-    void data_recived_impl();
+    T const& operator[](size_t i) const { return ptr[i]; }
+    T const& back() const { return ptr[count - 1]; }
 
-    AccelerometerHandler handler;
+private:
+    T const* ptr;
+    size_t count;
 };
 
 }
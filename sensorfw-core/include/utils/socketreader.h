@@ -27,11 +27,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
 #include <vector>
 
 #include <glib.h>
 #include <gio/gio.h>
 
+#include <utils/sample_span.h>
+
 /**
  * @brief Helper class for reading socket datachannel from sensord
  *
@@ -62,7 +68,17 @@ public:
     bool initiateConnection(int sessionId);
 
     /**
-     * Drops socket connection.
+     * Initiates new data socket connection without blocking on the
+     * connect or on the session handshake. Must be called from a thread
+     * running a GMainContext, the callback is invoked from that context.
+     *
+     * @param sessionId ID for the current session.
+     * @param done Called with whether the connection was established.
+     */
+    void initiateConnectionAsync(int sessionId, std::function<void(bool)> const& done);
+
+    /**
+     * Drops socket connection, or cancels the one being initiated.
      * @return was the connection successfully closed.
      */
     bool dropConnection();
@@ -95,6 +111,36 @@ public:
     template<typename T>
     bool read(std::vector<T>& values);
 
+    /**
+     * Attempt to read one frame of objects from the socket into the frame
+     * buffer owned by this reader. The buffer is allocated for the largest
+     * allowed batch on first use and reused afterwards, so steady-state
+     * reads do not allocate.
+     *
+     * Never blocks: whatever part of a frame is waiting is kept in the
+     * frame buffer and the frame is completed by later calls.
+     *
+     * @param values View of the parsed objects. Valid until the next read.
+     * @tparam T type of expected object in the stream.
+     * @return true if a complete frame was read.
+     */
+    template<typename T>
+    bool read(waydroid::core::SampleSpan<T>& values);
+
+    /**
+     * Number of heap allocations done for the frame buffer of this reader.
+     *
+     * @return allocation count.
+     */
+    unsigned long frameAllocations() const;
+
+    /**
+     * Number of frame buffer allocations done by all readers of the process.
+     *
+     * @return allocation count.
+     */
+    static unsigned long totalFrameAllocations();
+
     /**
      * Returns whether the socket is currently connected.
      *
@@ -103,12 +149,38 @@ public:
     bool isConnected();
 
 private:
+    /**
+     * Upper bound of objects in one frame. Bigger frames are flushed.
+     */
+    static const unsigned int maxBatchSamples = 1000;
+
     /**
      * Prefix text needed to be written to the sensor daemon socket connection
      * when establishing new session.
      */
     static const char* channelIDString;
 
+    /**
+     * Sends the session ID over the fresh connection and reads its tag.
+     */
+    void setupConnection(int sessionId);
+
+    /**
+     * Completion of initiateConnectionAsync().
+     */
+    static void connected(GObject* source, GAsyncResult* result, gpointer user_data);
+
+    /**
+     * Asynchronous handshake steps of initiateConnectionAsync().
+     */
+    static void sessionIdWritten(GObject* source, GAsyncResult* result, gpointer user_data);
+    static void socketTagRead(GObject* source, GAsyncResult* result, gpointer user_data);
+
+    /**
+     * Returns the address of the sensord socket.
+     */
+    static GSocketAddress* sensordAddress();
+
     /**
      * Reads initial magic byte from the fresh connection.
      */
@@ -119,10 +191,41 @@ private:
      */
     void skipAll();
 
+    /**
+     * Reads what is waiting on the socket, up to the missing part of
+     * size bytes at buffer of which filled are there already.
+     *
+     * @return false on errors and at the end of the stream.
+     */
+    bool readAvailable(void* buffer, size_t size, size_t* filled);
+
+    /**
+     * Drops the partially read frame.
+     */
+    void resetFrame();
+
+    /**
+     * Switches the socket to non-blocking reads once the handshake is done.
+     */
+    void setNonBlocking();
+
+    /**
+     * Returns the frame buffer, growing it to at least given size.
+     */
+    void* frameBuffer(size_t size);
+
     GSocketConnection* socket_; /**< socket data connection to sensord */
+    GCancellable* cancellable_; /**< of the pending initiateConnectionAsync() */
     GInputStream* istream_; /**< input of socket. owned by socket. */
     GOutputStream* ostream_; /**< output of socket. owned by socket. */
     bool tagRead_; /**< is initial magic byte read from the socket */
+    void* frame_; /**< reusable frame buffer */
+    size_t frameSize_; /**< size of frame buffer in bytes */
+    unsigned int frameCount_; /**< object count of the frame being read */
+    size_t headerFill_; /**< bytes of frameCount_ read so far */
+    size_t frameFill_; /**< bytes of the frame objects read so far */
+    unsigned long frameAllocations_; /**< frame buffer allocations */
+    static std::atomic<unsigned long> totalFrameAllocations_;
 };
 
 template<typename T>
@@ -138,7 +241,7 @@ bool SocketReader::read(std::vector<T>& values)
         skipAll();
         return false;
     }
-    if(count > 1000)
+    if(count > maxBatchSamples)
     {
         g_warning("Too many samples waiting in socket. Flushing it to empty");
         skipAll();
@@ -153,3 +256,53 @@ bool SocketReader::read(std::vector<T>& values)
     }
     return true;
 }
+
+template<typename T>
+bool SocketReader::read(waydroid::core::SampleSpan<T>& values)
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "socket samples are copied as raw bytes");
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "frame buffer is only aligned to max_align_t");
+
+    if (!socket_) {
+        return false;
+    }
+
+    if (headerFill_ < sizeof(frameCount_))
+    {
+        if (!readAvailable(&frameCount_, sizeof(frameCount_), &headerFill_))
+        {
+            resetFrame();
+            skipAll();
+            return false;
+        }
+        /* The rest of the header comes with a later G_IO_IN */
+        if (headerFill_ < sizeof(frameCount_))
+            return false;
+
+        if (frameCount_ > maxBatchSamples)
+        {
+            g_warning("Too many samples waiting in socket. Flushing it to empty");
+            resetFrame();
+            skipAll();
+            return false;
+        }
+    }
+
+    void* frame = frameBuffer(sizeof(T) * maxBatchSamples);
+    size_t const size = sizeof(T) * frameCount_;
+    if (!readAvailable(frame, size, &frameFill_))
+    {
+        g_warning("Error occured while reading data from socket");
+        resetFrame();
+        skipAll();
+        return false;
+    }
+    if (frameFill_ < size)
+        return false;
+
+    values = waydroid::core::SampleSpan<T>{static_cast<T const*>(frame), frameCount_};
+    resetFrame();
+    return frameCount_ > 0;
+}
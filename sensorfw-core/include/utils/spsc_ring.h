@@ -0,0 +1,108 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace waydroid
+{
+namespace core
+{
+
+/*
+ * Bounded single-producer/single-consumer ring buffer.
+ *
+ * push() may only be called from one thread and pop()/front() from one
+ * (possibly different) thread. Neither side takes a lock. When the ring is
+ * full push() refuses the new element and counts it in dropped().
+ */
+template<typename T, size_t N>
+class SpscRing
+{
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    SpscRing() : head{0}, tail{0}, drops{0} {}
+
+    static constexpr size_t capacity() { return N; }
+
+    bool push(T const& value)
+    {
+        size_t const t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+        {
+            drops.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        slots[t & (N - 1)] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Oldest element, or nullptr if the ring is empty. Consumer side only. */
+    T const* front() const
+    {
+        size_t const h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &slots[h & (N - 1)];
+    }
+
+    bool pop(T* out)
+    {
+        size_t const h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+
+        *out = slots[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const
+    {
+        size_t const h = head.load(std::memory_order_acquire);
+        return tail.load(std::memory_order_acquire) - h;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    /* Elements pushed and popped so far, refused pushes are not counted.
+     * Both keep growing, compare them by their difference. */
+    size_t pushed() const { return tail.load(std::memory_order_acquire); }
+    size_t popped() const { return head.load(std::memory_order_acquire); }
+
+    size_t dropped() const { return drops.load(std::memory_order_relaxed); }
+
+private:
+    SpscRing(SpscRing const&) = delete;
+    SpscRing& operator=(SpscRing const&) = delete;
+
+    /* Keep the producer and consumer indices on separate cache lines */
+    std::atomic<size_t> head;
+    char head_pad[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    std::atomic<size_t> drops;
+    char tail_pad[64 - 2 * sizeof(std::atomic<size_t>)];
+    T slots[N];
+};
+
+}
+}
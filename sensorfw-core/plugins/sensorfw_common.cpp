@@ -22,31 +22,80 @@
 
 #include <utils/socketreader.h>
 
+#include <chrono>
+
 namespace
 {
-auto const null_handler = [](double){};
 char const* const dbus_sensorfw_name = "com.nokia.SensorService";
 char const* const dbus_sensorfw_path = "/SensorManager";
 char const* const dbus_sensorfw_interface = "local.SensorManager";
+
+/* Completion of the control calls nobody waits for, failures are only logged */
+void control_call_finished(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    auto const method = static_cast<char const*>(user_data);
+    g_autoptr(GError) err = NULL;
+    auto const reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &err);
+
+    if (!reply)
+    {
+        GINFO("failed to call %s on SensorfwSensor: %s", method, err->message);
+        return;
+    }
+    g_variant_unref(reply);
+}
+
+/* Gives a session back to sensorfw, needs no channel so it also works for
+ * one that went away while the session was being requested */
+void release_session(GDBusConnection* connection, char const* plugin, int session)
+{
+    int constexpr timeout_default = 1000;
+    g_dbus_connection_call(
+            connection,
+            dbus_sensorfw_name,
+            dbus_sensorfw_path,
+            dbus_sensorfw_interface,
+            "releaseSensor",
+            g_variant_new("(six)", plugin, session, (gint64)getpid()),
+            G_VARIANT_TYPE("(b)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            timeout_default,
+            NULL,
+            &control_call_finished,
+            const_cast<char*>("releaseSensor"));
+}
+
+std::chrono::milliseconds session_idle_timeout()
+{
+    static std::chrono::milliseconds const timeout{[]
+        {
+            char const* env = getenv("WAYDROID_SENSORS_IDLE_RELEASE_MS");
+            return env ? strtol(env, nullptr, 10) : 10000L;
+        }()};
+    return timeout;
+}
 }
 
 waydroid::core::Sensorfw::Sensorfw(
-    std::string const& dbus_bus_address,
-    std::string const& name,
-    PluginType const& plugin)
-    : dbus_connection{dbus_bus_address},
-      dbus_event_loop{name},
+    std::shared_ptr<DBusConnectionHandle> const& dbus_connection,
+    EventLoop& event_loop,
+    char const* plugin_name,
+    char const* interface_name,
+    DataHandler data_handler)
+    : dbus_connection{dbus_connection},
+      dbus_event_loop{event_loop},
       m_socket(std::make_shared<SocketReader>()),
-      m_plugin(plugin),
+      m_plugin_string(plugin_name),
+      m_plugin_interface(interface_name),
+      m_data_handler(data_handler),
       m_pluginPath(nullptr, free),
       m_pid(getpid()),
+      m_sessionid(-1),
+      m_interval(0),
+      m_release_generation(0),
+      m_lifetime(std::make_shared<int>(0)),
       m_gsource(nullptr, g_source_unref)
 {
-    if (!load_plugin())
-        throw std::runtime_error("Could not create sensorfw backend");
-
-    request_sensor();
-
     char *new_str;
     if (asprintf(&new_str,"%s/%s", dbus_sensorfw_path, plugin_string()) == -1)
         GINFO("Unable to create the plugin path.");
@@ -56,64 +105,32 @@ waydroid::core::Sensorfw::Sensorfw(
     GINFO("Got plugin_string %s", plugin_string());
     GINFO("Got plugin_interface %s", plugin_interface());
     GINFO("Got plugin_path %s", plugin_path());
-
-    dbus_event_loop.enqueue([this]{
-        m_socket->initiateConnection(m_sessionid);
-    }).get();
 }
 
 waydroid::core::Sensorfw::~Sensorfw()
 {
-    stop();
-    release_sensor();
+    GDEBUG("%s did %lu frame buffer allocation(s)",
+           plugin_string(), m_socket->frameAllocations());
 
     dbus_event_loop.enqueue([this]{
+        /* Turns pending idle releases into no-ops */
+        m_lifetime.reset();
+
+        stop();
+        if (m_sessionid >= 0)
+            release_sensor();
         m_socket->dropConnection();
     }).get();
 }
 
 const char* waydroid::core::Sensorfw::plugin_string() const
 {
-    switch (m_plugin) {
-        case PluginType::ACCELEROMETER: return "accelerometersensor";
-        case PluginType::COMPASS: return "compasssensor";
-        case PluginType::GYROSCOPE: return "gyroscopesensor";
-        case PluginType::HUMIDITY: return "humiditysensor";
-        case PluginType::LID: return "lidsensor";
-        case PluginType::LIGHT : return "alssensor";
-        case PluginType::MAGNETOMETER: return "magnetometersensor";
-        case PluginType::ORIENTATION: return "orientationsensor";
-        case PluginType::PRESSURE: return "pressuresensor";
-        case PluginType::PROXIMITY: return "proximitysensor";
-        case PluginType::ROTATION: return "rotationsensor";
-        case PluginType::STEPCOUNTER: return "stepcountersensor";
-        case PluginType::TAP: return "tapsensor";
-        case PluginType::TEMPERATURE: return "temperaturesensor";
-    }
-
-    return "";
+    return m_plugin_string;
 }
 
 const char* waydroid::core::Sensorfw::plugin_interface() const
 {
-    switch (m_plugin) {
-        case PluginType::ACCELEROMETER: return "local.AccelerometerSensor";
-        case PluginType::COMPASS: return "local.CompassSensor";
-        case PluginType::GYROSCOPE: return "local.GyroscopeSensor";
-        case PluginType::HUMIDITY: return "local.HumiditySensor";
-        case PluginType::LID: return "local.LidSensor";
-        case PluginType::LIGHT: return "local.ALSSensor";
-        case PluginType::MAGNETOMETER: return "local.MagnetometerSensor";
-        case PluginType::ORIENTATION: return "local.OrientationSensor";
-        case PluginType::PRESSURE: return "local.PressureSensor";
-        case PluginType::PROXIMITY: return "local.ProximitySensor";
-        case PluginType::ROTATION: return "local.RotationSensor";
-        case PluginType::STEPCOUNTER: return "local.StepCounterSensor";
-        case PluginType::TAP: return "local.TapSensor";
-        case PluginType::TEMPERATURE: return "local.TemperatureSensor";
-    }
-
-    return "";
+    return m_plugin_interface;
 }
 
 const char* waydroid::core::Sensorfw::plugin_path() const
@@ -124,12 +141,53 @@ const char* waydroid::core::Sensorfw::plugin_path() const
     return m_pluginPath.get();
 }
 
-bool waydroid::core::Sensorfw::load_plugin()
+struct waydroid::core::Sensorfw::OpenContext
+{
+    Sensorfw* self;
+    /* Expires once the channel goes away with the call still pending */
+    std::weak_ptr<int> lifetime;
+    char const* plugin;
+    std::promise<void> done;
+};
+
+std::future<void> waydroid::core::Sensorfw::probe()
+{
+    auto const ctx = new OpenContext{this, m_lifetime, m_plugin_string, {}};
+    auto future = ctx->done.get_future();
+
+    /* The replies are dispatched from the context the calls are made on */
+    dbus_event_loop.enqueue([this, ctx]{ load_plugin(ctx); });
+
+    return future;
+}
+
+std::future<void> waydroid::core::Sensorfw::open_session()
+{
+    auto const ctx = new OpenContext{this, m_lifetime, m_plugin_string, {}};
+    auto future = ctx->done.get_future();
+
+    dbus_event_loop.enqueue([this, ctx]
+        {
+            /* Keep a pending idle release from closing the session */
+            m_release_generation++;
+
+            if (m_sessionid >= 0)
+            {
+                ctx->done.set_value();
+                delete ctx;
+                return;
+            }
+            request_sensor(ctx);
+        });
+
+    return future;
+}
+
+void waydroid::core::Sensorfw::load_plugin(OpenContext* ctx)
 {
     int constexpr timeout_default = 10000;
-    g_autoptr(GError) err = NULL;
-    auto const result =  g_dbus_connection_call_sync(
-            dbus_connection,
+    g_dbus_connection_call(
+            *dbus_connection,
             dbus_sensorfw_name,
             dbus_sensorfw_path,
             dbus_sensorfw_interface,
@@ -139,27 +197,44 @@ bool waydroid::core::Sensorfw::load_plugin()
             G_DBUS_CALL_FLAGS_NONE,
             timeout_default,
             NULL,
-            &err);
+            &Sensorfw::static_plugin_loaded,
+            ctx);
+}
+
+void waydroid::core::Sensorfw::static_plugin_loaded(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    auto ctx = static_cast<OpenContext*>(user_data);
+    g_autoptr(GError) err = NULL;
+    auto const reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &err);
 
+    gboolean the_result = FALSE;
     if (err != NULL)
     {
         GINFO("failed to call load_plugin: %s", err->message);
-        g_variant_unref(result);
-        return false;
+    }
+    else
+    {
+        g_variant_get(reply, "(b)", &the_result);
+        g_variant_unref(reply);
     }
 
-    gboolean the_result;
-    g_variant_get(result, "(b)", &the_result);
-    g_variant_unref(result);
-
-    return the_result;
+    if (!the_result)
+    {
+        ctx->done.set_exception(std::make_exception_ptr(
+            std::runtime_error("Could not create sensorfw backend")));
+    }
+    else
+    {
+        ctx->done.set_value();
+    }
+    delete ctx;
 }
 
-void waydroid::core::Sensorfw::request_sensor()
+void waydroid::core::Sensorfw::request_sensor(OpenContext* ctx)
 {
     int constexpr timeout_default = 5000;
-    auto const result =  g_dbus_connection_call_sync(
-            dbus_connection,
+    g_dbus_connection_call(
+            *dbus_connection,
             dbus_sensorfw_name,
             dbus_sensorfw_path,
             dbus_sensorfw_interface,
@@ -169,50 +244,91 @@ void waydroid::core::Sensorfw::request_sensor()
             G_DBUS_CALL_FLAGS_NONE,
             timeout_default,
             NULL,
-            NULL);
+            &Sensorfw::static_sensor_requested,
+            ctx);
+}
+
+void waydroid::core::Sensorfw::static_sensor_requested(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    auto ctx = static_cast<OpenContext*>(user_data);
+    auto self = ctx->self;
+    g_autoptr(GError) err = NULL;
+    auto const reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &err);
+
+    gint32 the_result = -1;
+    if (!reply)
+    {
+        GINFO("failed to call request_sensor: %s", err->message);
+    }
+    else
+    {
+        g_variant_get(reply, "(i)", &the_result);
+        g_variant_unref(reply);
+    }
 
-    if (!result)
+    /* sensorfw hands out -1 when it refuses the session */
+    if (the_result < 0)
     {
-        GINFO("failed to call request_sensor");
+        ctx->done.set_exception(std::make_exception_ptr(
+            std::runtime_error("Could not request sensorfw session")));
+        delete ctx;
         return;
     }
 
-    gint32 the_result;
-    g_variant_get(result, "(i)", &the_result);
-    g_variant_unref(result);
+    /* The channel is gone and could not release what it never saw */
+    if (ctx->lifetime.expired())
+    {
+        release_session(G_DBUS_CONNECTION(source), ctx->plugin, the_result);
+        ctx->done.set_exception(std::make_exception_ptr(
+            std::runtime_error("sensorfw channel closed")));
+        delete ctx;
+        return;
+    }
 
-    m_sessionid = the_result;
+    self->m_sessionid = the_result;
 
-    GINFO("Got new plugin for %s with pid %i and session %i", plugin_string(), m_pid, m_sessionid);
-}
+    GINFO("Got new plugin for %s with pid %i and session %i", self->plugin_string(), self->m_pid, self->m_sessionid);
 
-bool waydroid::core::Sensorfw::release_sensor()
-{
-    int constexpr timeout_default = 1000;
-    auto const result =  g_dbus_connection_call_sync(
-            dbus_connection,
-            dbus_sensorfw_name,
-            dbus_sensorfw_path,
-            dbus_sensorfw_interface,
-            "releaseSensor",
-            g_variant_new("(six)", plugin_string(), m_sessionid, m_pid),
-            G_VARIANT_TYPE("(b)"),
-            G_DBUS_CALL_FLAGS_NONE,
-            timeout_default,
-            NULL,
-            NULL);
+    if (self->m_interval > 0)
+        self->set_interval(self->m_interval);
 
-    if (!result)
-    {
-        GINFO("failed to release SensorfwSensor");
-        return false;
-    }
+    self->connect_socket(ctx);
+}
 
-    gboolean the_result;
-    g_variant_get(result, "(b)", &the_result);
-    g_variant_unref(result);
+void waydroid::core::Sensorfw::connect_socket(OpenContext* ctx)
+{
+    m_socket->initiateConnectionAsync(m_sessionid, [this, ctx](bool connected){
+        /* The channel released the session itself when it went away */
+        if (ctx->lifetime.expired())
+        {
+            ctx->done.set_exception(std::make_exception_ptr(
+                std::runtime_error("sensorfw channel closed")));
+            delete ctx;
+            return;
+        }
+
+        if (!connected)
+        {
+            GINFO("failed to connect the %s data socket", plugin_string());
+
+            /* Give the session back so the next activation starts over */
+            release_sensor();
+            m_sessionid = -1;
+
+            ctx->done.set_exception(std::make_exception_ptr(
+                std::runtime_error("Could not connect sensorfw data socket")));
+        }
+        else
+        {
+            ctx->done.set_value();
+        }
+        delete ctx;
+    });
+}
 
-    return the_result;
+void waydroid::core::Sensorfw::release_sensor()
+{
+    release_session(*dbus_connection, plugin_string(), m_sessionid);
 }
 
 gboolean waydroid::core::Sensorfw::static_data_recieved(GSocket * /* socket */, GIOCondition cond, gpointer user_data)
@@ -221,16 +337,65 @@ gboolean waydroid::core::Sensorfw::static_data_recieved(GSocket * /* socket */,
         return G_SOURCE_CONTINUE;
 
     auto self = reinterpret_cast<Sensorfw *>(user_data);
-    self->data_recived_impl();
+    self->m_data_handler(self);
 
     return G_SOURCE_CONTINUE;
 }
 
-void waydroid::core::Sensorfw::start()
+void waydroid::core::Sensorfw::schedule_release()
 {
-    if (m_gsource)
+    auto const timeout = session_idle_timeout();
+    auto const generation = ++m_release_generation;
+
+    if (timeout.count() <= 0)
+    {
+        close_session();
+        return;
+    }
+
+    std::weak_ptr<int> const lifetime = m_lifetime;
+    dbus_event_loop.schedule_in(timeout, [this, generation, lifetime]
+        {
+            if (lifetime.expired())
+                return;
+            /* Restarted or reopened since, keep the session */
+            if (generation == m_release_generation)
+                close_session();
+        });
+}
+
+void waydroid::core::Sensorfw::close_session()
+{
+    if (m_gsource || m_sessionid < 0)
         return;
 
+    GINFO("Releasing idle %s session %i", plugin_string(), m_sessionid);
+
+    m_socket->dropConnection();
+    release_sensor();
+    m_sessionid = -1;
+}
+
+std::future<void> waydroid::core::Sensorfw::start()
+{
+    auto const ctx = new OpenContext{this, m_lifetime, m_plugin_string, {}};
+    auto future = ctx->done.get_future();
+
+    if (m_gsource)
+    {
+        ctx->done.set_value();
+        delete ctx;
+        return future;
+    }
+
+    if (!m_socket->isConnected())
+    {
+        GINFO("no data socket for %s, not starting", plugin_string());
+        ctx->done.set_value();
+        delete ctx;
+        return future;
+    }
+
     GSocket *socket = g_socket_connection_get_socket(m_socket->socket());
     m_gsource = std::unique_ptr<GSource, decltype(&g_source_unref)> {
         g_socket_create_source(socket, G_IO_IN, /* cancellable */ NULL),
@@ -248,8 +413,8 @@ void waydroid::core::Sensorfw::start()
     g_source_attach(m_gsource.get(), g_main_context_get_thread_default());
 
     int constexpr timeout_default = 5000;
-    auto const result =  g_dbus_connection_call_sync(
-            dbus_connection,
+    g_dbus_connection_call(
+            *dbus_connection,
             dbus_sensorfw_name,
             plugin_path(),
             plugin_interface(),
@@ -259,15 +424,32 @@ void waydroid::core::Sensorfw::start()
             G_DBUS_CALL_FLAGS_NONE,
             timeout_default,
             NULL,
-            NULL);
+            &Sensorfw::static_started,
+            ctx);
+
+    return future;
+}
+
+void waydroid::core::Sensorfw::static_started(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    auto ctx = static_cast<OpenContext*>(user_data);
+    g_autoptr(GError) err = NULL;
+    auto const reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &err);
 
-    if (!result)
+    if (!reply)
     {
-        GINFO("failed to start SensorfwSensor");
-        stop();
-        return;
+        GINFO("failed to start SensorfwSensor: %s", err->message);
+        if (!ctx->lifetime.expired())
+            ctx->self->stop();
+        ctx->done.set_exception(std::make_exception_ptr(
+            std::runtime_error("Could not start sensorfw session")));
+    }
+    else
+    {
+        g_variant_unref(reply);
+        ctx->done.set_value();
     }
-    g_variant_unref(result);
+    delete ctx;
 }
 
 void waydroid::core::Sensorfw::stop()
@@ -276,8 +458,8 @@ void waydroid::core::Sensorfw::stop()
         return;
 
     int constexpr timeout_default = 1000;
-    auto const result =  g_dbus_connection_call_sync(
-            dbus_connection,
+    g_dbus_connection_call(
+            *dbus_connection,
             dbus_sensorfw_name,
             plugin_path(),
             plugin_interface(),
@@ -287,23 +469,32 @@ void waydroid::core::Sensorfw::stop()
             G_DBUS_CALL_FLAGS_NONE,
             timeout_default,
             NULL,
-            NULL);
-
-    if (!result)
-    {
-        GINFO("failed to stop SensorfwSensor");
-    } else {
-        g_variant_unref(result);
-    }
+            &control_call_finished,
+            const_cast<char*>("stop"));
 
     g_source_destroy(m_gsource.get());
     m_gsource.reset();
+
+    schedule_release();
+}
+
+void waydroid::core::Sensorfw::request_interval(int interval)
+{
+    dbus_event_loop.enqueue([this, interval]
+        {
+            if (interval == m_interval)
+                return;
+
+            m_interval = interval;
+            if (m_sessionid >= 0)
+                set_interval(m_interval);
+        });
 }
 
 void waydroid::core::Sensorfw::set_interval(int interval) {
     int constexpr timeout_default = 1000;
-    auto const result =  g_dbus_connection_call_sync(
-            dbus_connection,
+    g_dbus_connection_call(
+            *dbus_connection,
             dbus_sensorfw_name,
             plugin_path(),
             plugin_interface(),
@@ -313,12 +504,6 @@ void waydroid::core::Sensorfw::set_interval(int interval) {
             G_DBUS_CALL_FLAGS_NONE,
             timeout_default,
             NULL,
-            NULL);
-
-    if (!result)
-    {
-        GINFO("set_interval() failed to releaseSensor");
-        return;
-    }
-    g_variant_unref(result);
+            &control_call_finished,
+            const_cast<char*>("setInterval"));
 }
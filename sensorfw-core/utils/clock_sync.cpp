@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <utils/clock_sync.h>
+
+#include <algorithm>
+
+namespace
+{
+/* Lowest offsets are collected over windows of this length */
+int64_t constexpr window_length = 1000000000LL;
+/* Drift is only trusted once measured over this long */
+int64_t constexpr min_drift_baseline = 10000000000LL;
+/* Crystal drift beyond this is noise, not drift */
+int64_t constexpr max_drift_ppb = 500000;
+/* A whole window arriving this much late is a clock step, not delay */
+int64_t constexpr step_threshold = 50000000LL;
+}
+
+waydroid::core::ClockSync::ClockSync()
+    : synced{false},
+      base_remote{0},
+      base_offset{0},
+      drift{0},
+      window_start{0},
+      window_min{0},
+      window_min_remote{0},
+      anchored{false},
+      anchor_min{0},
+      anchor_remote{0}
+{
+}
+
+int64_t waydroid::core::ClockSync::to_local(int64_t remote, int64_t arrival)
+{
+    int64_t const observed = arrival - remote;
+
+    /* First sample, or the remote clock went backwards */
+    if (!synced || remote < base_remote)
+    {
+        reset(remote, observed);
+        return arrival;
+    }
+
+    /* Arrived sooner than predicted, the offset can only be lower */
+    if (observed < predict(remote))
+    {
+        base_remote = remote;
+        base_offset = observed;
+    }
+
+    if (observed < window_min)
+    {
+        window_min = observed;
+        window_min_remote = remote;
+    }
+
+    if (remote - window_start >= window_length)
+    {
+        int64_t const excess = window_min - predict(window_min_remote);
+
+        if (excess > step_threshold)
+        {
+            /* E.g. the local clock kept running during suspend */
+            reset(window_min_remote, window_min);
+        }
+        else
+        {
+            /* Follow the envelope up slowly, faster samples pull it down */
+            if (excess > 0)
+            {
+                base_offset = predict(window_min_remote) + excess / 8;
+                base_remote = window_min_remote;
+            }
+
+            /* Drift is measured against the first window, so the
+             * baseline and with it the precision grow over time */
+            int64_t const baseline = window_min_remote - anchor_remote;
+            if (!anchored)
+            {
+                anchored = true;
+                anchor_min = window_min;
+                anchor_remote = window_min_remote;
+            }
+            else if (baseline >= min_drift_baseline)
+            {
+                int64_t const measured =
+                    (window_min - anchor_min) * 1000000 / (baseline / 1000);
+                drift = std::max(-max_drift_ppb, std::min(max_drift_ppb, measured));
+            }
+        }
+
+        window_start = remote;
+        window_min = observed;
+        window_min_remote = remote;
+    }
+
+    return remote + predict(remote);
+}
+
+int64_t waydroid::core::ClockSync::predict(int64_t remote) const
+{
+    /* In microseconds, so hours without a rebase can't overflow */
+    return base_offset + (remote - base_remote) / 1000 * drift / 1000000;
+}
+
+void waydroid::core::ClockSync::reset(int64_t remote, int64_t offset)
+{
+    synced = true;
+    base_remote = remote;
+    base_offset = offset;
+    drift = 0;
+
+    window_start = remote;
+    window_min = offset;
+    window_min_remote = remote;
+    anchored = false;
+}
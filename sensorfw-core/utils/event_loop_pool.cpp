@@ -0,0 +1,39 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <utils/event_loop_pool.h>
+
+waydroid::core::EventLoopPool::EventLoopPool(std::string const& name, size_t size)
+    : next_loop{0}
+{
+    if (size == 0)
+        size = 1;
+
+    for (size_t i = 0; i < size; i++)
+        loops.push_back(std::make_unique<EventLoop>(name + "-" + std::to_string(i)));
+}
+
+size_t waydroid::core::EventLoopPool::size() const
+{
+    return loops.size();
+}
+
+waydroid::core::EventLoop& waydroid::core::EventLoopPool::next()
+{
+    auto& loop = *loops[next_loop];
+    next_loop = (next_loop + 1) % loops.size();
+    return loop;
+}
@@ -41,18 +41,47 @@
 #include <gio/gunixsocketaddress.h>
 
 const char* SocketReader::channelIDString = "_SENSORCHANNEL_";
+std::atomic<unsigned long> SocketReader::totalFrameAllocations_{0};
 
 SocketReader::SocketReader() :
     socket_(NULL),
-    tagRead_(false)
+    cancellable_(NULL),
+    tagRead_(false),
+    frame_(NULL),
+    frameSize_(0),
+    frameCount_(0),
+    headerFill_(0),
+    frameFill_(0),
+    frameAllocations_(0)
 {
 }
 
 SocketReader::~SocketReader()
 {
-    if (socket_) {
-        dropConnection();
-    }
+    dropConnection();
+    ::operator delete(frame_);
+}
+
+namespace
+{
+struct ConnectContext
+{
+    ~ConnectContext() { g_object_unref(cancellable); }
+
+    /* Only valid while cancellable is not cancelled */
+    SocketReader* reader;
+    int sessionId;
+    std::function<void(bool)> done;
+    GCancellable* cancellable;
+};
+}
+
+GSocketAddress* SocketReader::sensordAddress()
+{
+    const std::string SOCKET_NAME {"/var/run/sensord.sock"};
+    const char* env = getenv("SENSORFW_SOCKET_PATH");
+    auto full_path = env ? env : "" + SOCKET_NAME;
+    return g_unix_socket_address_new(full_path.c_str());
 }
 
 bool SocketReader::initiateConnection(int sessionId)
@@ -62,11 +91,8 @@ bool SocketReader::initiateConnection(int sessionId)
         return false;
     }
 
-    const std::string SOCKET_NAME {"/var/run/sensord.sock"};
-    const char* env = getenv("SENSORFW_SOCKET_PATH");
-    auto full_path = env ? env : "" + SOCKET_NAME;
     auto sock_addr = std::unique_ptr<GSocketAddress, decltype(&g_object_unref)>{
-        g_unix_socket_address_new(full_path.c_str()), g_object_unref};
+        sensordAddress(), g_object_unref};
 
     auto sock_client = std::unique_ptr<GSocketClient, decltype(&g_object_unref)>{
         g_socket_client_new(), g_object_unref};
@@ -83,6 +109,143 @@ bool SocketReader::initiateConnection(int sessionId)
         return false;
     }
 
+    setupConnection(sessionId);
+    setNonBlocking();
+
+    return true;
+}
+
+void SocketReader::initiateConnectionAsync(int sessionId, std::function<void(bool)> const& done)
+{
+    if (socket_ != NULL) {
+        g_debug("attempting to initiate connection on connected socket");
+        done(false);
+        return;
+    }
+
+    auto sock_addr = std::unique_ptr<GSocketAddress, decltype(&g_object_unref)>{
+        sensordAddress(), g_object_unref};
+
+    /* The pending operation keeps its own references to both */
+    auto sock_client = std::unique_ptr<GSocketClient, decltype(&g_object_unref)>{
+        g_socket_client_new(), g_object_unref};
+
+    /* Cancelled by dropConnection(), the reader may be gone by the time
+     * the operations complete */
+    if (cancellable_) {
+        g_cancellable_cancel(cancellable_);
+        g_object_unref(cancellable_);
+    }
+    cancellable_ = g_cancellable_new();
+
+    g_socket_client_connect_async(
+        sock_client.get(),
+        G_SOCKET_CONNECTABLE(sock_addr.get()),
+        cancellable_,
+        &SocketReader::connected,
+        new ConnectContext{this, sessionId, done,
+                           static_cast<GCancellable*>(g_object_ref(cancellable_))});
+}
+
+void SocketReader::connected(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    std::unique_ptr<ConnectContext> ctx{static_cast<ConnectContext*>(user_data)};
+
+    g_autoptr(GError) err = NULL;
+    GSocketConnection* socket = g_socket_client_connect_finish(G_SOCKET_CLIENT(source), result, &err);
+
+    if (g_cancellable_is_cancelled(ctx->cancellable)) {
+        if (socket)
+            g_object_unref(socket);
+        ctx->done(false);
+        return;
+    }
+
+    if (!socket) {
+        g_debug("Failed to connect to socket: %s", err->message);
+        ctx->done(false);
+        return;
+    }
+
+    SocketReader* self = ctx->reader;
+    self->socket_ = socket;
+
+    self->istream_ = g_io_stream_get_input_stream(G_IO_STREAM(self->socket_));
+    self->ostream_ = g_io_stream_get_output_stream(G_IO_STREAM(self->socket_));
+
+    /* The session ID is written from the context, it must outlive the call */
+    auto const raw = ctx.release();
+    g_output_stream_write_all_async(
+        self->ostream_,
+        &raw->sessionId,
+        sizeof(raw->sessionId),
+        G_PRIORITY_DEFAULT,
+        raw->cancellable,
+        &SocketReader::sessionIdWritten,
+        raw);
+}
+
+void SocketReader::sessionIdWritten(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    std::unique_ptr<ConnectContext> ctx{static_cast<ConnectContext*>(user_data)};
+
+    g_autoptr(GError) err = NULL;
+    gboolean const written = g_output_stream_write_all_finish(
+        G_OUTPUT_STREAM(source), result, NULL, &err);
+
+    if (g_cancellable_is_cancelled(ctx->cancellable)) {
+        ctx->done(false);
+        return;
+    }
+
+    SocketReader* self = ctx->reader;
+    if (!written) {
+        g_debug("[SOCKETREADER]: SessionId write failed: %s", err->message);
+        self->dropConnection();
+        ctx->done(false);
+        return;
+    }
+
+    g_input_stream_skip_async(
+        self->istream_,
+        /* count */ 1,
+        G_PRIORITY_DEFAULT,
+        ctx->cancellable,
+        &SocketReader::socketTagRead,
+        ctx.release());
+}
+
+void SocketReader::socketTagRead(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    std::unique_ptr<ConnectContext> ctx{static_cast<ConnectContext*>(user_data)};
+
+    g_autoptr(GError) err = NULL;
+    gssize const skipped = g_input_stream_skip_finish(G_INPUT_STREAM(source), result, &err);
+
+    if (g_cancellable_is_cancelled(ctx->cancellable)) {
+        ctx->done(false);
+        return;
+    }
+
+    SocketReader* self = ctx->reader;
+    self->tagRead_ = skipped == 1;
+
+    if (!self->tagRead_) {
+        g_debug("[SOCKETREADER]: reading the socket tag failed: %s",
+                err ? err->message : "end of stream");
+        self->dropConnection();
+        ctx->done(false);
+        return;
+    }
+
+    self->setNonBlocking();
+    ctx->done(true);
+}
+
+void SocketReader::setupConnection(int sessionId)
+{
+    g_autoptr(GError) err = NULL;
+
     istream_ = g_io_stream_get_input_stream(G_IO_STREAM(socket_));
     ostream_ = g_io_stream_get_output_stream(G_IO_STREAM(socket_));
 
@@ -103,12 +266,17 @@ bool SocketReader::initiateConnection(int sessionId)
     }
 
     readSocketTag();
-
-    return true;
 }
 
 bool SocketReader::dropConnection()
 {
+    /* Turns a connection still being set up into a no-op */
+    if (cancellable_) {
+        g_cancellable_cancel(cancellable_);
+        g_object_unref(cancellable_);
+        cancellable_ = NULL;
+    }
+
     if (!socket_)
         return false;
 
@@ -124,6 +292,7 @@ bool SocketReader::dropConnection()
     socket_ = NULL;
 
     tagRead_ = false;
+    resetFrame();
 
     return true;
 }
@@ -183,17 +352,64 @@ bool SocketReader::isConnected()
         !g_io_stream_is_closed(G_IO_STREAM(socket_)));
 }
 
+bool SocketReader::readAvailable(void* buffer, size_t size, size_t* filled)
+{
+    while (*filled < size) {
+        g_autoptr(GError) err = NULL;
+
+        gssize bytes = g_pollable_input_stream_read_nonblocking(
+            G_POLLABLE_INPUT_STREAM(istream_),
+            (char *)buffer + *filled,
+            size - *filled,
+            /* cancellable */ NULL,
+            /* (out) err */ &err);
+
+        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            return true;
+
+        if (err) {
+            g_warning("Failed to read from socket: %s. Unexpected things might occur.", err->message);
+            return false;
+        }
+
+        if (bytes == 0) {
+            // This is EOF. No further reading possible.
+            return false;
+        }
+
+        *filled += bytes;
+    }
+    return true;
+}
+
+void SocketReader::resetFrame()
+{
+    headerFill_ = 0;
+    frameFill_ = 0;
+}
+
+void SocketReader::setNonBlocking()
+{
+    g_socket_set_blocking(g_socket_connection_get_socket(socket_), FALSE);
+}
+
 void SocketReader::skipAll()
 {
-    while (g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(istream_))) {
+    char scratch[4096];
+
+    for (;;) {
         g_autoptr(GError) err = NULL;
 
-        auto ret = g_input_stream_skip(
-            istream_,
-            /* count */ G_MAXSSIZE,
+        auto ret = g_pollable_input_stream_read_nonblocking(
+            G_POLLABLE_INPUT_STREAM(istream_),
+            scratch,
+            sizeof(scratch),
             /* cancellable */ NULL,
             /* (out) error */ &err);
 
+        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            break;
+
         if (err) {
             g_warning("Cannot skip the stream: %s. Unexpected things might occur.", err->message);
             break;
@@ -205,3 +421,26 @@ void SocketReader::skipAll()
         }
     }
 }
+
+void* SocketReader::frameBuffer(size_t size)
+{
+    if (frameSize_ < size) {
+        /* operator new returns storage aligned for any fundamental type */
+        ::operator delete(frame_);
+        frame_ = ::operator new(size);
+        frameSize_ = size;
+        frameAllocations_++;
+        totalFrameAllocations_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return frame_;
+}
+
+unsigned long SocketReader::frameAllocations() const
+{
+    return frameAllocations_;
+}
+
+unsigned long SocketReader::totalFrameAllocations()
+{
+    return totalFrameAllocations_.load(std::memory_order_relaxed);
+}
@@ -16,9 +16,15 @@
  * Authored by: Erfan Abdi <erfangplus@gmail.com>
  */
 
+#include "PollReply.h"
 #include "Sensors.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 using waydroid::sensors::implementation::Sensors;
+using waydroid::sensors::implementation::poll_reply_alloc_events;
+using waydroid::sensors::implementation::poll_reply_write;
 
 #define RET_OK          (0)
 #define RET_NOTFOUND    (1)
@@ -35,15 +41,36 @@ typedef struct app {
     GBinderLocalObject* obj;
     int ret;
     Sensors *service;
+    /* POLL requests are served one by one by a blocking worker thread */
+    GAsyncQueue* poll_queue;
+    GThread* poll_thread;
+    /* Control-plane transactions run here, next to a pending POLL */
+    GThreadPool* tx_pool;
+    /* GET_SENSORS_LIST reply, refers to the list cached by the service */
+    GBinderHidlVec sensors_vec;
 } App;
 
 typedef struct response {
     GBinderRemoteRequest* req;
     GBinderLocalReply* reply;
+    guint code;
     int maxCount;
+    gint32 handle;
+    gboolean enabled;
+    gint64 samplingPeriodNs;
+    gint64 maxReportLatencyNs;
+    /* Direct channel requests */
+    gint32 channelHandle;
+    gint32 rate;
+    SharedMemInfo mem;
+    int fd;
     Sensors *service;
 } Response;
 
+/* Threads serving GET_SENSORS_LIST, ACTIVATE, BATCH, FLUSH and the direct
+ * channel transactions */
+#define TRANSACTION_WORKERS 4
+
 static const char logtag[] = "waydroid-sensors-daemon";
 
 static
@@ -99,30 +126,74 @@ sensors_write_info_strings(
     sensors_write_hidl_string_data(w, sensor, requiredPermission, idx, off);
 }
 
+static
+void
+app_build_sensors_list(
+    App* app)
+{
+    const std::vector<sensor_t>& sensors = app->service->getSensorsList();
+
+    /* Fill in the vector descriptor */
+    if (!sensors.empty()) {
+        app->sensors_vec.data.ptr = sensors.data();
+        app->sensors_vec.count = sensors.size();
+    }
+    app->sensors_vec.owns_buffer = TRUE;
+}
+
+static
+void
+app_write_sensors_list(
+    GBinderWriter* writer,
+    const App* app)
+{
+    const sensor_t* sensors = (const sensor_t*) app->sensors_vec.data.ptr;
+    const guint sensors_len = app->sensors_vec.count;
+    guint index;
+    GBinderParent vec_parent;
+
+    /* The cached list outlives the reply, the buffers are written as is */
+    vec_parent.index = gbinder_writer_append_buffer_object(writer,
+        &app->sensors_vec, sizeof(app->sensors_vec));
+    vec_parent.offset = GBINDER_HIDL_VEC_BUFFER_OFFSET;
+
+    index = gbinder_writer_append_buffer_object_with_parent(writer,
+        sensors, sensors_len * sizeof(*sensors), &vec_parent);
+
+    for (guint i = 0; i < sensors_len; i++)
+        sensors_write_info_strings(writer, sensors + i, index, i);
+}
+
+/* Queued to stop the POLL worker */
+static Response app_poll_stop;
+
 static
 gboolean
 app_async_resp(
     gpointer user_data)
 {
     Response* resp = (Response*)user_data;
+
+    gbinder_remote_request_complete(resp->req, resp->reply, 0);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+app_poll_reply(
+    Response* resp)
+{
     int err = 0;
     GBinderWriter writer;
 
-    std::vector<sensors_event_t> event_vec = resp->service->poll(resp->maxCount, &err);
-    sensors_event_t *event = &event_vec[0];
-    int event_len = event_vec.size();
-
     gbinder_local_reply_init_writer(resp->reply, &writer);
-    gbinder_writer_append_int32(&writer, err);
-    gbinder_writer_append_hidl_vec(&writer, (void *)event, event_len, sizeof(sensors_event_t));
 
-    std::vector<sensor_t> sensors_vec;
-    sensor_t *sensors = &sensors_vec[0];
-    int sensors_len = sensors_vec.size();
-    gbinder_writer_append_hidl_vec(&writer, (void *)sensors, sensors_len, sizeof(sensor_t));
+    /* Events are drained straight into the reply */
+    sensors_event_t* events = poll_reply_alloc_events(&writer,
+        Sensors::pollBufferSize(resp->maxCount));
+    const gsize count = resp->service->poll(resp->maxCount, events, &err);
 
-    gbinder_remote_request_complete(resp->req, resp->reply, 0);
-    return G_SOURCE_REMOVE;
+    poll_reply_write(&writer, err, events, count);
 }
 
 static
@@ -137,6 +208,104 @@ app_async_free(
     g_free(resp);
 }
 
+/* Blocks in Sensors::poll() so the main loop stays free for the other
+ * transactions. The filled in reply is completed back on the main loop. */
+static
+gpointer
+app_poll_worker(
+    gpointer user_data)
+{
+    App* app = (App*) user_data;
+    Response* resp;
+
+    while ((resp = (Response*) g_async_queue_pop(app->poll_queue)) != &app_poll_stop) {
+        app_poll_reply(resp);
+        g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT, app_async_resp,
+                                   resp, app_async_free);
+    }
+
+    return NULL;
+}
+
+/* Takes over |reply|, the request is completed once a worker filled it in */
+static
+Response*
+app_response_new(
+    App* app,
+    GBinderRemoteRequest* req,
+    GBinderLocalReply* reply,
+    guint code)
+{
+    Response* resp = g_new0(Response, 1);
+
+    resp->service = app->service;
+    resp->code = code;
+    resp->reply = reply;
+    resp->req = gbinder_remote_request_ref(req);
+    gbinder_remote_request_block(resp->req);
+    return resp;
+}
+
+static
+void
+app_transaction_worker(
+    gpointer data,
+    gpointer user_data)
+{
+    App* app = (App*) user_data;
+    Response* resp = (Response*)data;
+    GBinderWriter writer;
+
+    gbinder_local_reply_init_writer(resp->reply, &writer);
+
+    switch (resp->code) {
+    case GET_SENSORS_LIST:
+        app_write_sensors_list(&writer, app);
+        break;
+    case ACTIVATE:
+        gbinder_writer_append_int32(&writer,
+            resp->service->activate(resp->handle, resp->enabled == TRUE));
+        break;
+    case BATCH:
+        gbinder_writer_append_int32(&writer, resp->service->batch(resp->handle,
+            resp->samplingPeriodNs, resp->maxReportLatencyNs));
+        break;
+    case FLUSH:
+        gbinder_writer_append_int32(&writer, resp->service->flush(resp->handle));
+        break;
+    case REGISTER_DIRECT_CHANNEL: {
+        int32_t channelHandle = -1;
+        int result = RESULT_BAD_VALUE;
+
+        if (resp->fd >= 0) {
+            result = resp->service->registerDirectChannel(resp->mem.type,
+                resp->mem.format, resp->fd, resp->mem.size, &channelHandle);
+            close(resp->fd);
+        }
+        gbinder_writer_append_int32(&writer, result);
+        gbinder_writer_append_int32(&writer, channelHandle);
+        break;
+    }
+    case UNREGISTER_DIRECT_CHANNEL:
+        gbinder_writer_append_int32(&writer,
+            resp->service->unregisterDirectChannel(resp->channelHandle));
+        break;
+    case CONFIG_DIRECT_REPORT: {
+        int32_t reportToken = 0;
+
+        gbinder_writer_append_int32(&writer, resp->service->configDirectReport(
+            resp->handle, resp->channelHandle, (RateLevel)resp->rate, &reportToken));
+        gbinder_writer_append_int32(&writer, reportToken);
+        break;
+    }
+    default:
+        break;
+    }
+
+    g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT, app_async_resp,
+                               resp, app_async_free);
+}
+
 static
 GBinderLocalReply*
 app_reply(
@@ -162,36 +331,9 @@ app_reply(
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            sensor_t* sensors;
-            std::vector<sensor_t> sensors_vec = app->service->getSensorsList();
-            int sensors_len = sensors_vec.size();
-
-            gbinder_local_reply_init_writer(reply, &writer);
-
-            guint index;
-            GBinderParent vec_parent;
-            GBinderHidlVec *vec = gbinder_writer_new0(&writer, GBinderHidlVec);
-            const gsize total = sensors_len * sizeof(*sensors);
-            sensors = (sensor_t*) gbinder_writer_malloc0(&writer, total);
-
-            /* Fill in the vector descriptor */
-            if (sensors) {
-                vec->data.ptr = sensors;
-                vec->count = sensors_len;
-            }
-            vec->owns_buffer = TRUE;
-
-            std::copy(sensors_vec.begin(), sensors_vec.end(), sensors);
-
-            /* Prepare parent descriptor for the string data */
-            vec_parent.index = gbinder_writer_append_buffer_object(&writer, vec, sizeof(*vec));
-            vec_parent.offset = GBINDER_HIDL_VEC_BUFFER_OFFSET;
-
-            index = gbinder_writer_append_buffer_object_with_parent(&writer,
-                sensors, total, &vec_parent);
-
-            for (int i = 0; i < sensors_len; i++)
-                sensors_write_info_strings(&writer, sensors + i, index, i);
+            Response* resp = app_response_new(app, req, reply, code);
+            g_thread_pool_push(app->tx_pool, resp, NULL);
+            return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
         }
@@ -225,8 +367,11 @@ app_reply(
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            gbinder_local_reply_init_writer(reply, &writer);
-            gbinder_writer_append_int32(&writer, app->service->activate(handle, enabled == TRUE));
+            Response* resp = app_response_new(app, req, reply, code);
+            resp->handle = handle;
+            resp->enabled = enabled;
+            g_thread_pool_push(app->tx_pool, resp, NULL);
+            return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
         }
@@ -242,14 +387,9 @@ app_reply(
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            Response* resp = g_new0(Response, 1);
-            resp->service = app->service;
+            Response* resp = app_response_new(app, req, reply, code);
             resp->maxCount = maxCount;
-            resp->reply = reply;
-            resp->req = gbinder_remote_request_ref(req);
-            g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, app_async_resp,
-                                resp, app_async_free);
-            gbinder_remote_request_block(resp->req);
+            g_async_queue_push(app->poll_queue, resp);
             return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
@@ -258,19 +398,24 @@ app_reply(
         const char* iface = gbinder_remote_request_interface(req);
 
         if (!g_strcmp0(iface, DEFAULT_IFACE)) {
-            gint32 tmp = 0;
-            gint64 tmp64 = 0;
-            gbinder_reader_read_int32(&reader, &tmp);
-            gbinder_reader_read_int64(&reader, &tmp64);
-            gbinder_reader_read_int64(&reader, &tmp64);
+            gint32 handle = 0;
+            gint64 samplingPeriodNs = 0;
+            gint64 maxReportLatencyNs = 0;
+            gbinder_reader_read_int32(&reader, &handle);
+            gbinder_reader_read_int64(&reader, &samplingPeriodNs);
+            gbinder_reader_read_int64(&reader, &maxReportLatencyNs);
 
             reply = gbinder_local_object_new_reply(obj);
 
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            gbinder_local_reply_init_writer(reply, &writer);
-            gbinder_writer_append_int32(&writer, RESULT_OK);
+            Response* resp = app_response_new(app, req, reply, code);
+            resp->handle = handle;
+            resp->samplingPeriodNs = samplingPeriodNs;
+            resp->maxReportLatencyNs = maxReportLatencyNs;
+            g_thread_pool_push(app->tx_pool, resp, NULL);
+            return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
         }
@@ -286,8 +431,10 @@ app_reply(
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            gbinder_local_reply_init_writer(reply, &writer);
-            gbinder_writer_append_int32(&writer, app->service->flush(handle));
+            Response* resp = app_response_new(app, req, reply, code);
+            resp->handle = handle;
+            g_thread_pool_push(app->tx_pool, resp, NULL);
+            return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
         }
@@ -309,14 +456,24 @@ app_reply(
         const char* iface = gbinder_remote_request_interface(req);
 
         if (!g_strcmp0(iface, DEFAULT_IFACE)) {
+            const SharedMemInfo* mem = gbinder_reader_read_hidl_struct(&reader, SharedMemInfo);
+            const GBinderFds* fds = mem ? gbinder_reader_read_fds(&reader) : NULL;
+
             reply = gbinder_local_object_new_reply(obj);
 
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            gbinder_local_reply_init_writer(reply, &writer);
-            gbinder_writer_append_int32(&writer, RESULT_INVALID_OPERATION);
-            gbinder_writer_append_int32(&writer, -1);
+            Response* resp = app_response_new(app, req, reply, code);
+            resp->fd = -1;
+            /* The fds follow the native_handle header. The worker gets its
+             * own copy, independent of the request buffers. */
+            if (fds && fds->num_fds > 0) {
+                resp->mem = *mem;
+                resp->fd = fcntl(((const int*)(fds + 1))[0], F_DUPFD_CLOEXEC, 0);
+            }
+            g_thread_pool_push(app->tx_pool, resp, NULL);
+            return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
         }
@@ -324,16 +481,18 @@ app_reply(
         const char* iface = gbinder_remote_request_interface(req);
 
         if (!g_strcmp0(iface, DEFAULT_IFACE)) {
-            int tmp = 0;
-            gbinder_reader_read_int32(&reader, &tmp);
+            int channelHandle = 0;
+            gbinder_reader_read_int32(&reader, &channelHandle);
 
             reply = gbinder_local_object_new_reply(obj);
 
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            gbinder_local_reply_init_writer(reply, &writer);
-            gbinder_writer_append_int32(&writer, RESULT_OK);
+            Response* resp = app_response_new(app, req, reply, code);
+            resp->channelHandle = channelHandle;
+            g_thread_pool_push(app->tx_pool, resp, NULL);
+            return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
         }
@@ -341,14 +500,24 @@ app_reply(
         const char* iface = gbinder_remote_request_interface(req);
 
         if (!g_strcmp0(iface, DEFAULT_IFACE)) {
+            gint32 sensorHandle = 0;
+            gint32 channelHandle = 0;
+            gint32 rate = 0;
+            gbinder_reader_read_int32(&reader, &sensorHandle);
+            gbinder_reader_read_int32(&reader, &channelHandle);
+            gbinder_reader_read_int32(&reader, &rate);
+
             reply = gbinder_local_object_new_reply(obj);
 
             gbinder_local_reply_append_int32(reply, GBINDER_STATUS_OK);
             *status = GBINDER_STATUS_OK;
 
-            gbinder_local_reply_init_writer(reply, &writer);
-            gbinder_writer_append_int32(&writer, RESULT_INVALID_OPERATION);
-            gbinder_writer_append_int32(&writer, -1);
+            Response* resp = app_response_new(app, req, reply, code);
+            resp->handle = sensorHandle;
+            resp->channelHandle = channelHandle;
+            resp->rate = rate;
+            g_thread_pool_push(app->tx_pool, resp, NULL);
+            return NULL;
         } else {
             GDEBUG("Unexpected interface \"%s\"", iface);
         }
@@ -385,6 +554,8 @@ app_sm_presence_handler(
 
     if (gbinder_servicemanager_is_present(app->sm)) {
         GINFO("Service manager has reappeared");
+        /* The first POLL of the new client must not see the old kill */
+        app->service->resumeLoops();
         gbinder_servicemanager_add_service(app->sm, DEFAULT_NAME, app->obj,
             app_add_service_done, app);
     } else {
@@ -405,6 +576,10 @@ app_run(
         (app->sm, app_sm_presence_handler, app);
 
     app->loop = g_main_loop_new(NULL, TRUE);
+    app->poll_queue = g_async_queue_new();
+    app->poll_thread = g_thread_new("sensors-poll", app_poll_worker, app);
+    app->tx_pool = g_thread_pool_new(app_transaction_worker, app,
+                                     TRANSACTION_WORKERS, FALSE, NULL);
 
     gbinder_servicemanager_add_service(app->sm, DEFAULT_NAME, app->obj,
         app_add_service_done, app);
@@ -416,6 +591,14 @@ app_run(
     if (sigtrm) g_source_remove(sigtrm);
     if (sigint) g_source_remove(sigint);
     gbinder_servicemanager_remove_handler(app->sm, presence_id);
+
+    g_thread_pool_free(app->tx_pool, FALSE, TRUE);
+
+    app->service->killLoops();
+    g_async_queue_push(app->poll_queue, &app_poll_stop);
+    g_thread_join(app->poll_thread);
+    g_async_queue_unref(app->poll_queue);
+
     g_main_loop_unref(app->loop);
     app->loop = NULL;
 }
@@ -437,6 +620,7 @@ int main(int argc, char* argv[])
     memset(&app, 0, sizeof(app));
     app.ret = RET_INVARG;
     app.service = new Sensors();
+    app_build_sensors_list(&app);
 
     app.sm = gbinder_servicemanager_new2(device, "hidl", "hidl");
     if (gbinder_servicemanager_wait(app.sm, -1)) {
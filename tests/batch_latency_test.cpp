@@ -0,0 +1,126 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A POLL sleeping on empty FIFOs must pick up the deadline of a batched
+ * event queued after it went to sleep, and return once the report latency
+ * of that event is up rather than when the FIFO fills.
+ */
+
+#include "Sensors.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+
+using namespace waydroid::sensors::implementation;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* maxReportLatency of the batched sensor */
+constexpr int64_t kLatencyNs = 200000000LL;
+/* Scheduling allowance on top of it */
+constexpr int64_t kSlackNs = 300000000LL;
+
+int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+void test_batched_deadline() {
+    /* The event path only, without sensorfw behind it */
+    std::unique_ptr<SensorDevice> dev(new SensorDevice());
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_mutex_init(&dev->direct_lock, NULL);
+    pthread_mutex_init(&dev->fusion_lock, NULL);
+    pthread_mutex_init(&dev->flush_lock, NULL);
+    dev->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    dev->active_sensors = SENSORS_PRESSURE;
+    dev->max_report_latency[ID_PRESSURE] = kLatencyNs;
+
+    sensors_event_t events[4];
+    size_t count = 0;
+    int64_t returned = 0;
+    std::promise<void> done;
+    auto polled = done.get_future();
+
+    std::thread poller([&] {
+        count = sensor_device_poll(dev.get(), events, 4);
+        returned = clock_ns(CLOCK_BOOTTIME);
+        done.set_value();
+    });
+
+    /* Let the POLL go to sleep without any deadline */
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    sensors_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.sensorHandle = ID_PRESSURE;
+    event.sensorType = SENSOR_TYPE_PRESSURE;
+    event.u.scalar = 1013.25f;
+
+    int64_t const posted = clock_ns(CLOCK_BOOTTIME);
+    /* As a channel sink hands over one sample */
+    sensor_event_cb(dev.get(), ID_PRESSURE, clock_ns(CLOCK_MONOTONIC) / 1000, &event, 1);
+    sensor_wake_cb(dev.get());
+
+    bool const in_time = polled.wait_for(std::chrono::nanoseconds(kLatencyNs + kSlackNs)) ==
+                         std::future_status::ready;
+    CHECK(in_time);
+    if (!in_time) {
+        /* Unblock the POLL to end the test */
+        dev->killed = true;
+        eventfd_write(dev->wake_fd, 1);
+    }
+    poller.join();
+
+    if (in_time) {
+        CHECK(count == 1);
+        CHECK(events[0].sensorHandle == ID_PRESSURE);
+        /* Held for the latency, not delivered right away */
+        CHECK(returned - posted >= kLatencyNs - 10000000LL);
+    }
+
+    close(dev->wake_fd);
+}
+
+}
+
+int main() {
+    test_batched_deadline();
+
+    if (failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
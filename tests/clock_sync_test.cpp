@@ -0,0 +1,166 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feeds the sensord to CLOCK_BOOTTIME estimator a synthetic sample stream
+ * with delivery jitter, clock drift and a suspend, and checks the mapped
+ * timestamps against the time the samples were really taken.
+ */
+
+#include <utils/clock_sync.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cstdint>
+#include <random>
+
+using waydroid::core::ClockSync;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+constexpr int64_t kMs = 1000000LL;
+constexpr int64_t kSecond = 1000 * kMs;
+
+/* 100 Hz stream */
+constexpr int64_t kPeriod = 10 * kMs;
+/* Delivery takes at least this long, plus up to kJitter */
+constexpr int64_t kMinDelay = 1 * kMs;
+constexpr int64_t kJitter = 4 * kMs;
+/* Boot time sensord started at */
+constexpr int64_t kOffset = 42 * kSecond;
+/* Time spent suspended, seen by CLOCK_BOOTTIME only */
+constexpr int64_t kSuspend = 5 * kSecond;
+/* Error allowed once the estimator has settled */
+constexpr int64_t kTolerance = kMs / 2;
+
+struct Stream {
+    /* Drift of the sensord clock, in parts per billion */
+    int64_t drift_ppb;
+    /* Sensord time the device suspends at, or 0 */
+    int64_t suspend_at;
+};
+
+/* Runs |stream| for |duration| of sensord time, checking every sample */
+void run(Stream const& stream, int64_t duration) {
+    ClockSync sync;
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int64_t> jitter(0, kJitter);
+
+    int64_t last = INT64_MIN;
+    int64_t settled_from = 2 * kSecond;
+    int64_t worst = 0;
+    bool monotonic = true;
+    bool early = false;
+    bool off = false;
+
+    for (int64_t remote = kPeriod; remote <= duration; remote += kPeriod) {
+        int64_t taken = kOffset + remote + remote / 1000 * stream.drift_ppb / 1000000;
+        if (stream.suspend_at && remote >= stream.suspend_at)
+            taken += kSuspend;
+
+        /* Every hundredth sample comes through without any extra delay */
+        int64_t const delay = kMinDelay + (remote % (100 * kPeriod) ? jitter(rng) : 0);
+        int64_t const arrival = taken + delay;
+
+        int64_t const local = sync.to_local(remote, arrival);
+
+        if (local <= last)
+            monotonic = false;
+        last = local;
+
+        /* Samples never come from the future */
+        if (local > arrival)
+            early = true;
+
+        /* Allow for the estimator to notice the step first */
+        if (stream.suspend_at && remote == stream.suspend_at)
+            settled_from = remote + 2 * kSecond;
+        if (remote < settled_from)
+            continue;
+
+        /* The fastest delivery is all that can't be told from the offset */
+        int64_t const error = local - (taken + kMinDelay);
+        if (error > kTolerance || error < -kTolerance)
+            off = true;
+        if (llabs(error) > worst)
+            worst = llabs(error);
+    }
+
+    CHECK(monotonic);
+    CHECK(!early);
+    CHECK(!off);
+    if (off)
+        fprintf(stderr, "drift %lld ppb: worst error %lld ns\n",
+                (long long)stream.drift_ppb, (long long)worst);
+}
+
+void test_jitter() {
+    run({ 0, 0 }, 30 * kSecond);
+}
+
+void test_drift() {
+    /* A crystal running off either way, over a minute */
+    run({ 50000, 0 }, 60 * kSecond);
+    run({ -50000, 0 }, 60 * kSecond);
+}
+
+void test_suspend() {
+    run({ 20000, 0 }, 20 * kSecond);
+    run({ 20000, 10 * kSecond }, 40 * kSecond);
+}
+
+void test_drift_estimate() {
+    ClockSync sync;
+
+    for (int64_t remote = kPeriod; remote <= 60 * kSecond; remote += kPeriod)
+        sync.to_local(remote, kOffset + remote + remote / 1000 * 30000 / 1000000 + kMinDelay);
+
+    CHECK(sync.drift_ppb() > 29000 && sync.drift_ppb() < 31000);
+}
+
+void test_backwards() {
+    ClockSync sync;
+
+    sync.to_local(10 * kSecond, kOffset + 10 * kSecond);
+    /* A restarted sensord starts its clock over, nothing to map yet */
+    CHECK(sync.to_local(kSecond, kOffset + 11 * kSecond) == kOffset + 11 * kSecond);
+    CHECK(sync.offset() == kOffset + 10 * kSecond);
+}
+
+}
+
+int main() {
+    test_jitter();
+    test_drift();
+    test_suspend();
+    test_drift_estimate();
+    test_backwards();
+
+    if (failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright © 2021 Waydroid Project.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads a direct channel the way an Android client does: registers a
+ * memfd with the HAL, maps it separately and checks the records written
+ * into it against the SensorsEventFormatOffset layout.
+ */
+
+#include "DirectChannel.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace waydroid::sensors::implementation;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+constexpr size_t kRecordSize = (size_t)SensorsEventFormatOffset::TOTAL_LENGTH;
+/* Slots of the test channel, small enough to wrap around */
+constexpr size_t kSlots = 3;
+
+/* A client side view of one record */
+struct Record {
+    uint8_t const* base;
+
+    template<typename T>
+    T field(SensorsEventFormatOffset offset) const {
+        T value;
+        memcpy(&value, base + (size_t)offset, sizeof(value));
+        return value;
+    }
+
+    uint32_t counter() const {
+        return __atomic_load_n(reinterpret_cast<uint32_t const*>(
+            base + (size_t)SensorsEventFormatOffset::ATOMIC_COUNTER), __ATOMIC_ACQUIRE);
+    }
+};
+
+sensors_event_t make_event(int64_t timestamp, float x) {
+    sensors_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.sensorHandle = ID_ACCELEROMETER;
+    event.sensorType = SENSOR_TYPE_ACCELEROMETER;
+    event.timestamp = timestamp;
+    event.u.vec3.x = x;
+    event.u.vec3.y = x + 1;
+    event.u.vec3.z = x + 2;
+    return event;
+}
+
+void test_rate_levels() {
+    CHECK(direct_report_max_rate(0) == RateLevel::STOP);
+    CHECK(direct_report_max_rate(-1) == RateLevel::STOP);
+    CHECK(direct_report_max_rate(20000) == RateLevel::NORMAL);
+    CHECK(direct_report_max_rate(10000) == RateLevel::NORMAL);
+    CHECK(direct_report_max_rate(5000) == RateLevel::FAST);
+    CHECK(direct_report_max_rate(1000) == RateLevel::VERY_FAST);
+}
+
+void test_too_small() {
+    int const fd = memfd_create("direct-channel-test", MFD_CLOEXEC);
+    CHECK(fd >= 0);
+    CHECK(ftruncate(fd, kRecordSize - 1) == 0);
+
+    CHECK(!DirectChannel::create(dup(fd), kRecordSize - 1));
+    close(fd);
+}
+
+void test_records() {
+    size_t const size = kSlots * kRecordSize;
+    int const fd = memfd_create("direct-channel-test", MFD_CLOEXEC);
+    CHECK(fd >= 0);
+    CHECK(ftruncate(fd, size) == 0);
+
+    /* The HAL keeps its own copy of the fd, like for a binder request */
+    auto channel = DirectChannel::create(dup(fd), size);
+    CHECK(channel != nullptr);
+    if (!channel) {
+        close(fd);
+        return;
+    }
+
+    void* const client = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    CHECK(client != MAP_FAILED);
+    close(fd);
+    if (client == MAP_FAILED)
+        return;
+
+    Record records[kSlots];
+    for (size_t i = 0; i < kSlots; i++)
+        records[i].base = static_cast<uint8_t const*>(client) + i * kRecordSize;
+
+    /* Nothing is written before the sensor is configured */
+    channel->post(make_event(1000, 1.0f), 0);
+    CHECK(records[0].counter() == 0);
+
+    int32_t const token = channel->configure(ID_ACCELEROMETER, RateLevel::NORMAL);
+    CHECK(token > 0);
+    CHECK(channel->isReporting(ID_ACCELEROMETER));
+    CHECK(channel->periodNs(ID_ACCELEROMETER) == direct_report_period_ns(RateLevel::NORMAL));
+    CHECK(channel->reportedSensors() == SENSORS_ACCELEROMETER);
+
+    sensors_event_t const first = make_event(1000, 1.0f);
+    channel->post(first, 0);
+
+    Record const& record = records[0];
+    CHECK(record.counter() == 1);
+    CHECK(record.field<int32_t>(SensorsEventFormatOffset::SIZE_FIELD) == (int32_t)kRecordSize);
+    CHECK(record.field<int32_t>(SensorsEventFormatOffset::REPORT_TOKEN) == token);
+    CHECK(record.field<int32_t>(SensorsEventFormatOffset::SENSOR_TYPE) == SENSOR_TYPE_ACCELEROMETER);
+    CHECK(record.field<int64_t>(SensorsEventFormatOffset::TIMESTAMP) == 1000);
+    CHECK(memcmp(record.base + (size_t)SensorsEventFormatOffset::DATA,
+                 &first.u, sizeof(first.u)) == 0);
+
+    /* Faster than the configured rate, decimated */
+    channel->post(make_event(2000, 2.0f), 1000000);
+    CHECK(records[1].counter() == 0);
+
+    /* The counter keeps counting across the wrap around */
+    int64_t const period = direct_report_period_ns(RateLevel::NORMAL);
+    for (uint32_t i = 1; i <= kSlots; i++)
+        channel->post(make_event(1000 + i, (float)i), i * period);
+
+    CHECK(records[1].counter() == 2);
+    CHECK(records[2].counter() == 3);
+    CHECK(records[0].counter() == 4);
+    CHECK(records[0].field<int64_t>(SensorsEventFormatOffset::TIMESTAMP) == 1000 + kSlots);
+
+    /* Stopped sensors are no longer written */
+    channel->configure(ID_ACCELEROMETER, RateLevel::STOP);
+    CHECK(!channel->isReporting(ID_ACCELEROMETER));
+    CHECK(channel->reportedSensors() == 0);
+    channel->post(make_event(9000, 9.0f), 10 * period);
+    CHECK(records[1].counter() == 2);
+
+    munmap(client, size);
+}
+
+}
+
+int main() {
+    test_rate_levels();
+    test_too_small();
+    test_records();
+
+    if (failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}